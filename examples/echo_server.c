@@ -71,6 +71,13 @@ int main(int argc, char** argv) {
   }
   evwsconnlistener_set_error_cb(levws, ws_listener_error);
 
+  // the same server on io_uring, to compare the two
+  if (argc > 1 && strcmp(argv[1], "--io-uring") == 0 &&
+      evwsconnlistener_set_io_uring(levws, 1) < 0) {
+    fprintf(stderr, "io_uring is not available\n");
+    exit(-1);
+  }
+
   event_base_dispatch(base);
 
   return 0;
@@ -26,9 +26,180 @@
 #ifndef EVWSCONN_H_
 #define EVWSCONN_H_
 
+#include <stddef.h>
+
 struct bufferevent;
+struct event;
+struct event_base;
 struct evwsconn;
+struct evws_pool;
+struct evws_pool_stats;
+struct evwsbase_pool;
+struct evws_sockopts;
+struct evws_msg;
+struct evwsuring;
+struct io_uring_sqe;
+
+// Allocate memory through the allocator set by evws_set_allocator
+void* evws_malloc(size_t size);
+
+void* evws_realloc(void* ptr, size_t size);
+
+void evws_free(void* ptr);
+
+/* State shared by all listeners and connections on one event_base */
+struct evwsbase {
+  struct event_base* base;
+  // updated atomically, see evws_base.c
+  int refcnt;
+  struct evwsbase_pool* pools;
+  // connections waiting to be freed by free_ev, linked through next_free
+  struct evwsconn* free_head;
+  struct event* free_ev;
+  // messages collected during one read for a batch callback, see evws.c
+  struct evws_msg* batch_msgs;
+  size_t batch_len;
+  size_t batch_size;
+  unsigned char* batch_data;
+  size_t batch_data_len;
+  size_t batch_data_size;
+  // connections that used up their read budget, linked through next_ready
+  // and read again by ready_ev, see evws.c
+  struct evwsconn* ready_head;
+  struct evwsconn* ready_tail;
+  struct event* ready_ev;
+  // io_uring shared by the base's listeners and connections, or NULL
+  struct evwsuring* uring;
+  struct evwsbase* next;
+};
+
+// Get the state for base, creating it if needed, and take a reference on it.
+// Returns NULL on allocation failure.
+struct evwsbase* evwsbase_get(struct event_base* base);
+
+void evwsbase_incref(struct evwsbase* wsbase);
+
+void evwsbase_decref(struct evwsbase* wsbase);
+
+struct event_base* evwsbase_get_base(struct evwsbase* wsbase);
+
+// Get the pool for objects of the given size and alignment (0 for the
+// default) on this base, NULL on allocation failure
+struct evws_pool* evwsbase_get_pool(struct evwsbase* wsbase, size_t size,
+    size_t align);
+
+// Fill in up to max entries of stats, return the number of pools on the base
+int evwsbase_get_pool_stats(struct evwsbase* wsbase,
+    struct evws_pool_stats* stats, int max);
+
+/* Per-connection settings a listener passes to the connections it creates */
+struct evwsconn_config {
+  size_t userdata_size;
+  // move TLS connections onto kernel TLS once the upgrade has been sent
+  int ktls;
+  // adapt the TLS record size to how the connection is being used
+  int tls_record_sizing;
+  // read timeout after which idle connections release their buffers, as
+  // returned by event_base_init_common_timeout(), or NULL
+  const struct timeval* idle_timeout;
+  // read plain sockets directly instead of through the bufferevent
+  int direct_read;
+  // queue sends in the library beyond this many unsent bytes, 0 to disable
+  size_t notsent_lowat;
+  // send messages of at least this many bytes with MSG_ZEROCOPY, 0 to disable
+  size_t zerocopy_threshold;
+  // split messages into frames of at most this many bytes, 0 to disable
+  size_t max_frame_size;
+  // most bytes written to a connection per loop iteration, 0 for the default
+  size_t write_budget;
+  // most bytes and messages read per loop iteration, 0 for no limit
+  size_t read_budget_bytes;
+  size_t read_budget_messages;
+  // receive and send on plain sockets through the base's io_uring
+  int io_uring;
+};
+
+// Set the options in opts that aren't -1 on a socket, 0 if all succeeded
+int evws_apply_sockopts(int fd, const struct evws_sockopts* opts);
+
+// Connections are aligned so that their hot fields fill whole cache lines
+#define EVWSCONN_ALIGN 64
+
+// Create the events a base runs for its connections, -1 on failure
+int evwsconn_init_base(struct evwsbase* wsbase);
+
+// Size of the pooled allocation made for each connection
+size_t evwsconn_alloc_size(const struct evwsconn_config* config);
+
+struct evwsconn* evwsconn_new(struct evwsbase* wsbase, struct bufferevent* bev,
+    const char* subprotocol, const struct evwsconn_config* config);
+
+// Move a connection onto kernel TLS once its output has drained, as its
+// write callback does.  Called for connections whose upgrade response was
+// written before they were created, which have no write to wait for.
+void evwsconn_start_ktls(struct evwsconn* conn);
+
+/*
+ * An operation on a base's io_uring, see evws_uring.c.  It is embedded in
+ * whatever owns it, which must stay allocated until its last completion.
+ */
+struct evwsuring_op {
+  // called for each completion with the CQE's result and flags
+  void (*complete)(struct evwsuring_op* op, int res, unsigned int flags);
+  // called once just before the next submission, after evwsuring_defer()
+  void (*prepare)(struct evwsuring_op* op);
+  struct evwsuring_op* next_deferred;
+  int deferred;
+};
+
+/*
+ * The state of operations whose owner has gone, kept until their last
+ * completion.  The ring releases whatever is left when it is freed, after
+ * cancelling every request still in flight.
+ */
+struct evwsuring_orphan {
+  void (*release)(struct evwsuring_orphan* orphan);
+  struct evwsuring_orphan* next;
+};
+
+void evwsuring_adopt(struct evwsuring* ring, struct evwsuring_orphan* orphan);
+
+// Called by an orphan's last completion, before it releases itself
+void evwsuring_disown(struct evwsuring* ring,
+    struct evwsuring_orphan* orphan);
+
+// Get the base's ring, creating it on first use, NULL if the library was
+// built without io_uring or the kernel doesn't support what it needs
+struct evwsuring* evwsuring_get(struct evwsbase* wsbase);
+
+void evwsuring_free(struct evwsuring* ring);
+
+// Make sure count SQEs can be queued without submitting in between, which
+// would split a chain of linked SQEs, -1 if the ring is too small
+int evwsuring_reserve(struct evwsuring* ring, unsigned int count);
+
+// Get an SQE whose completions go to op, NULL if the ring is full.  It is
+// submitted with the others queued during the same round of callbacks.
+struct io_uring_sqe* evwsuring_get_sqe(struct evwsuring* ring,
+    struct evwsuring_op* op);
+
+// Submit what is queued now, e.g. before closing a descriptor it uses
+void evwsuring_submit(struct evwsuring* ring);
+
+// Have op prepare its SQEs just before the next submission
+void evwsuring_defer(struct evwsuring* ring, struct evwsuring_op* op);
+
+// Cancel every request of op, which still completes each of them
+int evwsuring_cancel(struct evwsuring* ring, struct evwsuring_op* op);
+
+// Prepare a multishot receive into the ring's provided buffers
+void evwsuring_prep_recv(struct evwsuring* ring, struct io_uring_sqe* sqe,
+    int fd);
+
+// The provided buffer a receive completion's data is in, and giving it back
+const unsigned char* evwsuring_buffer(struct evwsuring* ring,
+    unsigned int flags);
 
-struct evwsconn* evwsconn_new(struct bufferevent* bev, const char* subprotocol);
+void evwsuring_recycle(struct evwsuring* ring, unsigned int flags);
 
 #endif /* EVWSCONN_H_ */
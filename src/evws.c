@@ -26,42 +26,323 @@
 #include "evws/evws.h"
 #include "evws-internal.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #include <openssl/ssl.h>
 #include <event2/event.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/buffer.h>
+#include <event2/util.h>
 #include <wslay/wslay.h>
 
+#include "evws_pool.h"
+#include "evws_util.h"
+
+#ifdef EVWS_HAVE_URING
+#include <liburing.h>
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define EVWS_HAVE_ZEROCOPY
+#endif
+
+struct evwszerocopy;
+struct evwsconnuring;
+
+/*
+ * Fields used on every read come first and fill the first EVWSCONN_ALIGN
+ * bytes.  The read budget and the fields used on every write fill the next
+ * EVWSCONN_ALIGN bytes.  Connections are allocated EVWSCONN_ALIGN aligned,
+ * so these are two whole cache lines.  Fields only used when setting up,
+ * closing or tearing down, or only by optional features such as pacing,
+ * zerocopy and io_uring, follow.
+ */
 struct evwsconn {
-  unsigned char alive : 1;
   struct bufferevent* bev;
   wslay_event_context_ptr ctx;
   evwsconn_message_cb message_cb;
+  evwsconn_batch_cb batch_cb;
+  evwsconn_stream_cb stream_cb;
+  void* user_data;
+  uint64_t rx_unparsed;
+  short rx_events;
+  uint8_t rx_opcode;
+  unsigned char alive : 1;
+  unsigned char closing : 1;
+  unsigned char freeing : 1;
+  unsigned char rx_in_message : 1;
+  unsigned char rx_frame : 2;
+  unsigned char rx_throttled : 1;
+  unsigned char rx_queued : 1;
+  unsigned char rx_drained : 1;
+  unsigned char direct_read : 1;
+  unsigned char record_sizing : 1;
+  unsigned char tx_urgent : 1;
+  unsigned char ktls_pending : 1;
+  unsigned char has_userdata : 1;
+
+  struct event* read_ev;
+  size_t rx_bytes_left;
+  size_t rx_messages_left;
+  size_t read_budget_bytes;
+  size_t read_budget_messages;
+  struct evbuffer* queue;
+  size_t max_frame;
+  uint64_t tx_left;
+
   evwsconn_close_cb close_cb;
   evwsconn_error_cb error_cb;
   const char* subprotocol;
-  void* user_data;
+  struct evwsbase* wsbase;
+  struct evws_pool* pool;
+  struct evwsconngroup* group;
+  size_t group_index;
+  struct evwsconn* next_free;
+  unsigned int record_size;
+  size_t burst_bytes;
+  struct timeval last_write;
+  uint64_t small_record_bytes;
+  uint64_t full_record_bytes;
+  const struct timeval* idle_timeout;
+  uint64_t compactions;
+  size_t notsent_lowat;
+  evwsconn_writable_cb writable_cb;
+  struct evwszerocopy* zc;
+  struct evwsconnuring* uring;
+  struct evbuffer* reserved_buf;
+  unsigned char* reserved;
+  size_t reserved_len;
+  struct evwsconn* next_ready;
+  uint64_t read_throttles;
+};
+
+typedef char evwsconn_read_fields_fit_cache_line[
+    offsetof(struct evwsconn, read_ev) <= EVWSCONN_ALIGN ? 1 : -1];
+typedef char evwsconn_hot_fields_fit_two_cache_lines[
+    offsetof(struct evwsconn, close_cb) <= 2 * EVWSCONN_ALIGN ? 1 : -1];
+
+// What the frame being received is, for the stream callback
+#define RX_FRAME_CONTROL 0
+#define RX_FRAME_DATA 1
+#define RX_FRAME_LAST 2
+
+#define GROUP_SENDABLE 0x01
+#define GROUP_RECORD_SIZING 0x02
+#define GROUP_PACED 0x04
+
+/*
+ * TLS record sizing: after the connection has been idle, data is sent in
+ * records that fit in a single TCP segment so that the client can decrypt
+ * each one as soon as it arrives.  Once a burst has gone on long enough to
+ * be a bulk transfer, full size records are used to cut the per-record
+ * overhead.
+ */
+#define SMALL_RECORD_SIZE 1400
+#define FULL_RECORD_SIZE 16384
+#define RECORD_IDLE_RESET_MSEC 1000
+#define RECORD_BULK_BYTES (1024 * 1024)
+
+/*
+ * Connections are kept as a struct of arrays so that a broadcast only reads
+ * the dense flags and outputs arrays, and touches a connection itself only
+ * when something goes wrong.
+ */
+struct evwsconngroup {
+  size_t size;
+  size_t capacity;
+  struct evwsconn** conns;
+  struct evbuffer** outputs;
+  unsigned char* flags;
 };
 
+static void update_group(struct evwsconn* conn) {
+  if (conn->group) {
+    conn->group->flags[conn->group_index] =
+        (conn->alive && !conn->closing ? GROUP_SENDABLE : 0) |
+        (conn->queue ? GROUP_PACED :
+            conn->record_sizing ? GROUP_RECORD_SIZING : 0);
+  }
+}
+
+// Called before len bytes are added to the output of a connection with
+// record sizing enabled
+static void size_records(struct evwsconn* conn, size_t len) {
+  struct timeval now, idle;
+  event_base_gettimeofday_cached(conn->wsbase->base, &now);
+  // The record size is only changed while OpenSSL has nothing to write, as
+  // a pending SSL_write must be retried exactly as it was first made
+  if (evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+    evutil_timersub(&now, &conn->last_write, &idle);
+    if (idle.tv_sec * 1000 + idle.tv_usec / 1000 >= RECORD_IDLE_RESET_MSEC) {
+      conn->burst_bytes = 0;
+    }
+    unsigned int record_size = conn->burst_bytes >= RECORD_BULK_BYTES ?
+        FULL_RECORD_SIZE : SMALL_RECORD_SIZE;
+    if (record_size != conn->record_size) {
+      SSL *ssl = bufferevent_openssl_get_ssl(conn->bev);
+      if (ssl != NULL && SSL_set_max_send_fragment(ssl, record_size)) {
+        conn->record_size = record_size;
+      }
+    }
+  }
+  conn->burst_bytes += len;
+  conn->last_write = now;
+  if (conn->record_size == SMALL_RECORD_SIZE) {
+    conn->small_record_bytes += len;
+  } else {
+    conn->full_record_bytes += len;
+  }
+}
+
+/*
+ * Paced sending: with a send low mark, frames are queued on the connection
+ * rather than added to the bufferevent's output, and only moved there
+ * while the output holds less than the low mark.  The socket has
+ * TCP_NOTSENT_LOWAT set to the same mark, so it only reports writable, and
+ * the output only drains, once the kernel is close to running out of data
+ * to send.  Data that can't be sent yet therefore waits in the queue,
+ * where it is counted and visible to the application, rather than in the
+ * kernel.
+ */
+static struct evbuffer* send_buffer(struct evwsconn* conn) {
+  return conn->queue ? conn->queue : bufferevent_get_output(conn->bev);
+}
+
+static int zc_unsent(struct evwsconn* conn);
+static void zc_poll(struct evwsconn* conn);
+#ifdef EVWS_HAVE_ZEROCOPY
+static int zc_drained(struct evwsconn* conn);
+#endif
+static size_t uring_unsent(struct evwsconn* conn);
+static void uring_recv_stop(struct evwsconn* conn);
+
+/*
+ * With a maximum frame size, whole frames are moved, so that the output
+ * always ends between frames and pings and pongs can be added straight to
+ * it, ahead of whatever is queued.  Without a low mark, the output is kept
+ * to about one frame.
+ */
+static int pace_frames(struct evwsconn* conn) {
+  struct evbuffer* output = bufferevent_get_output(conn->bev);
+  size_t limit = conn->notsent_lowat ? conn->notsent_lowat : conn->max_frame;
+  while (evbuffer_get_length(output) + uring_unsent(conn) < limit) {
+    unsigned char header[EVWS_FRAME_HEADER_MAX];
+    ev_ssize_t n = evbuffer_copyout(conn->queue, header, sizeof(header));
+    uint64_t len = n > 0 ? evws_frame_length(header, n) : 0;
+    if (len == 0) {
+      break;
+    }
+    if (conn->record_sizing) {
+      size_records(conn, len);
+    }
+    if (evbuffer_remove_buffer(conn->queue, output, len) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int pace_output(struct evwsconn* conn) {
+  struct evbuffer* output = bufferevent_get_output(conn->bev);
+  size_t queued = evbuffer_get_length(conn->queue);
+  size_t pending = evbuffer_get_length(output) + uring_unsent(conn);
+  if (queued == 0 || zc_unsent(conn)) {
+    return 0;
+  }
+  if (conn->max_frame > 0) {
+    return pace_frames(conn);
+  }
+  size_t len = queued;
+  if (conn->notsent_lowat > 0) {
+    if (pending >= conn->notsent_lowat) {
+      return 0;
+    }
+    len = conn->notsent_lowat - pending;
+    if (len > queued) {
+      len = queued;
+    }
+  }
+  if (conn->record_sizing) {
+    size_records(conn, len);
+  }
+  return evbuffer_remove_buffer(conn->queue, output, len) < 0 ? -1 : 0;
+}
+
 static void ws_error(struct evwsconn* conn) {
   conn->alive = 0;
+  if (conn->read_ev != NULL) {
+    event_del(conn->read_ev);
+  }
+  uring_recv_stop(conn);
+  zc_poll(conn);
+  update_group(conn);
   if (conn->error_cb)
     conn->error_cb(conn, conn->user_data);
 }
 
 static void evwsconn_closing_cb(struct bufferevent *bev, void *conn_ptr) {
   struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  if (conn->queue && evbuffer_get_length(conn->queue) > 0) {
+    // the close frame is still queued
+    if (pace_output(conn) < 0) {
+      ws_error(conn);
+    }
+    return;
+  }
   conn->alive = 0;
+  update_group(conn);
   if (conn->close_cb)
     conn->close_cb(conn, conn->user_data);
 }
 
+static int ensure_ctx(struct evwsconn* conn);
+static void set_data_cbs(struct evwsconn* conn);
+static void deliver_batch(struct evwsconn* conn);
+static void queue_ready(struct evwsconn* conn);
+static int uring_resume(struct evwsconn* conn);
+
+/*
+ * wslay keeps a 4 KB receive buffer and its frame state in a context that
+ * lives as long as the connection.  On a connection that has been idle for
+ * the listener's idle timeout, the context is freed if it holds nothing: no
+ * unparsed input, no fragmented message, nothing queued to send and no
+ * close in progress.  It is recreated by ensure_ctx() on the next use.
+ * OpenSSL's buffers are released by SSL_MODE_RELEASE_BUFFERS, and libevent
+ * frees evbuffer chains as they are drained, so nothing else is held.
+ */
+static void compact_idle(struct evwsconn* conn) {
+  if (conn->ctx != NULL && conn->rx_unparsed == 0 && !conn->rx_in_message &&
+      !wslay_event_want_write(conn->ctx) &&
+      !wslay_event_get_close_sent(conn->ctx) &&
+      !wslay_event_get_close_received(conn->ctx) &&
+      evbuffer_get_length(bufferevent_get_input(conn->bev)) == 0) {
+    wslay_event_context_free(conn->ctx);
+    conn->ctx = NULL;
+    conn->compactions++;
+  }
+}
+
 static void evwsconn_event_cb(struct bufferevent *bev, short events,
     void *conn_ptr) {
   struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  if ((events & BEV_EVENT_TIMEOUT) && conn->idle_timeout != NULL) {
+    // a timeout disables reading, which an idle connection still wants
+    compact_idle(conn);
+    bufferevent_enable(bev, EV_READ);
+    return;
+  }
   if (events & BEV_EVENT_EOF) {
     if (conn->close_cb)
       conn->close_cb(conn, conn->user_data);
@@ -70,57 +351,1235 @@ static void evwsconn_event_cb(struct bufferevent *bev, short events,
   }
 }
 
-static void evwsconn_do_write(struct evwsconn* conn) {
-  if (wslay_event_want_write(conn->ctx)) {
-    if (wslay_event_send(conn->ctx) < 0) {
-      ws_error(conn);
-      return;
-    }
-  }
-  if (wslay_event_get_close_sent(conn->ctx)) {
-    bufferevent_setcb(conn->bev, NULL, evwsconn_closing_cb, evwsconn_event_cb,
-        conn);
+static void evwsconn_do_write(struct evwsconn* conn) {
+  if (conn->ctx == NULL) {
+    return;
+  }
+  if (wslay_event_want_write(conn->ctx)) {
+    if (wslay_event_send(conn->ctx) < 0 ||
+        (conn->queue && pace_output(conn) < 0)) {
+      ws_error(conn);
+      return;
+    }
+  }
+  if (wslay_event_get_close_sent(conn->ctx)) {
+    conn->closing = 1;
+    conn->ktls_pending = 0;
+    update_group(conn);
+    if (conn->read_ev != NULL) {
+      event_del(conn->read_ev);
+    }
+    uring_recv_stop(conn);
+    zc_poll(conn);
+    bufferevent_setcb(conn->bev, NULL, evwsconn_closing_cb, evwsconn_event_cb,
+        conn);
+  }
+}
+
+static void evwsconn_read_cb(struct bufferevent *bev, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  int ret;
+  if (ensure_ctx(conn) < 0) {
+    ws_error(conn);
+    return;
+  }
+  conn->rx_bytes_left = conn->read_budget_bytes ? conn->read_budget_bytes :
+      SIZE_MAX;
+  conn->rx_messages_left = conn->read_budget_messages ?
+      conn->read_budget_messages : SIZE_MAX;
+  conn->rx_throttled = 0;
+  ret = wslay_event_recv(conn->ctx);
+  // The batch is kept on the base, so it is emptied even if the batch
+  // callback was cleared, or the connection freed, during the read
+  deliver_batch(conn);
+  if (ret < 0) {
+    if (!conn->rx_events) {
+      ws_error(conn);
+    }
+    return;
+  }
+  if (conn->rx_throttled && !conn->freeing) {
+    queue_ready(conn);
+  }
+  evwsconn_do_write(conn);
+}
+
+// Read a plain socket directly, returns -1 if reading has stopped for good
+static int direct_read(struct evwsconn* conn) {
+  conn->rx_drained = 0;
+  evwsconn_read_cb(conn->bev, conn);
+  short rx_events = conn->rx_events;
+  if (rx_events) {
+    conn->rx_events = 0;
+    event_del(conn->read_ev);
+    evwsconn_event_cb(conn->bev, rx_events, conn);
+    return -1;
+  }
+  return 0;
+}
+
+static void evwsconn_direct_read_cb(evutil_socket_t fd, short events,
+    void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  if (events & EV_TIMEOUT) {
+    compact_idle(conn);
+    return;
+  }
+  direct_read(conn);
+}
+
+/*
+ * Read budget: each time a connection is read, it takes at most the
+ * listener's budget of bytes and messages.  One that has more to read then
+ * stops reading and goes at the back of its base's ready queue.  The queue
+ * is run by a zero timeout, so once per loop iteration after polling, and
+ * every connection on it at that point is read once more with a fresh
+ * budget, in the order they were queued.  Those that use up the budget
+ * again are queued for the next iteration, behind any that joined in
+ * between, so busy connections take turns and the quiet ones, read as
+ * their sockets become readable, never wait behind more than one budget
+ * from each.  Reading is only enabled again once a connection is through
+ * its input.
+ */
+static void resume_read(struct evwsconn* conn) {
+  if (!conn->alive || conn->closing || conn->freeing) {
+    return;
+  }
+  if (conn->read_ev != NULL) {
+    if (direct_read(conn) < 0) {
+      return;
+    }
+  } else {
+    evwsconn_read_cb(conn->bev, conn);
+  }
+  if (conn->rx_throttled || !conn->alive || conn->closing || conn->freeing) {
+    return;
+  }
+  if (conn->uring != NULL) {
+    if (uring_resume(conn) < 0) {
+      return;
+    }
+  } else if (conn->read_ev != NULL) {
+    event_add(conn->read_ev, conn->idle_timeout);
+  } else {
+    bufferevent_enable(conn->bev, EV_READ);
+  }
+  zc_poll(conn);
+}
+
+static void read_ready_conns(evutil_socket_t sock, short events,
+    void* wsbase_ptr) {
+  struct evwsbase* wsbase = (struct evwsbase*)wsbase_ptr;
+  // Connections are only freed by free_queued_conns(), so the ones taken
+  // off the queue stay valid, but the base needs a reference of its own
+  evwsbase_incref(wsbase);
+  struct evwsconn* head = wsbase->ready_head;
+  wsbase->ready_head = NULL;
+  wsbase->ready_tail = NULL;
+  while (head) {
+    struct evwsconn* conn = head;
+    head = conn->next_ready;
+    conn->next_ready = NULL;
+    conn->rx_queued = 0;
+    resume_read(conn);
+  }
+  evwsbase_decref(wsbase);
+}
+
+static void queue_ready(struct evwsconn* conn) {
+  struct evwsbase* wsbase = conn->wsbase;
+  conn->read_throttles++;
+  if (conn->rx_queued) {
+    return;
+  }
+  if (wsbase->ready_head == NULL) {
+    static const struct timeval zero = {0, 0};
+    if (event_add(wsbase->ready_ev, &zero) < 0) {
+      return; // keep reading as input arrives
+    }
+    wsbase->ready_head = conn;
+  } else {
+    wsbase->ready_tail->next_ready = conn;
+  }
+  wsbase->ready_tail = conn;
+  conn->rx_queued = 1;
+  if (conn->uring != NULL) {
+    uring_recv_stop(conn);
+  } else if (conn->read_ev != NULL) {
+    event_del(conn->read_ev);
+  } else {
+    bufferevent_disable(conn->bev, EV_READ);
+  }
+  zc_poll(conn);
+}
+
+static void unqueue_ready(struct evwsconn* conn) {
+  struct evwsbase* wsbase = conn->wsbase;
+  struct evwsconn** curr = &wsbase->ready_head;
+  struct evwsconn* prev = NULL;
+  while (*curr != conn) {
+    prev = *curr;
+    curr = &prev->next_ready;
+  }
+  *curr = conn->next_ready;
+  if (wsbase->ready_tail == conn) {
+    wsbase->ready_tail = prev;
+  }
+}
+
+/*
+ * A connection without OpenSSL in its read path can read the socket itself:
+ * recv_callback() then receives straight into wslay's parse buffer rather
+ * than through the bufferevent's input buffer, so no per-connection input
+ * buffer is kept, and one copy is saved on every read.  Anything already in
+ * the input buffer is handed to wslay first.  The bufferevent is still
+ * used for writing.
+ */
+static void start_direct_read(struct evwsconn* conn) {
+  if (!conn->direct_read || conn->uring != NULL ||
+      bufferevent_openssl_get_ssl(conn->bev) != NULL) {
+    return;
+  }
+  struct event* read_ev = event_new(bufferevent_get_base(conn->bev),
+      bufferevent_getfd(conn->bev), EV_READ|EV_PERSIST,
+      evwsconn_direct_read_cb, conn);
+  if (read_ev == NULL || event_add(read_ev, conn->idle_timeout) < 0) {
+    if (read_ev != NULL) {
+      event_free(read_ev);
+    }
+    return; // keep reading through the bufferevent
+  }
+  if (conn->read_ev != NULL) {
+    event_free(conn->read_ev);
+  }
+  conn->read_ev = read_ev;
+  bufferevent_disable(conn->bev, EV_READ);
+  if (evbuffer_get_length(bufferevent_get_input(conn->bev)) > 0) {
+    event_active(read_ev, EV_READ, 0);
+  }
+}
+
+/*
+ * Once OpenSSL has installed the session keys in the kernel for both
+ * directions, the socket can be read and written directly and OpenSSL is no
+ * longer needed.  The OpenSSL bufferevent is replaced by a plain one on a
+ * duplicate of the socket, so that freeing the old one (which closes its fd
+ * and frees the SSL) leaves the connection open.  This is only done once
+ * everything OpenSSL was given has been written and it holds no unread
+ * data.  Control records received afterwards (e.g. a TLS 1.3 KeyUpdate)
+ * can't be handled without OpenSSL and fail the connection.
+ */
+static void switch_to_ktls(struct evwsconn* conn) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+  struct bufferevent* old_bev = conn->bev;
+  SSL *ssl = bufferevent_openssl_get_ssl(old_bev);
+  if (evbuffer_get_length(bufferevent_get_output(old_bev)) > 0) {
+    return; // try again when the output has drained
+  }
+  conn->ktls_pending = 0;
+  if (ssl == NULL || !BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+      !BIO_get_ktls_recv(SSL_get_rbio(ssl)) || SSL_has_pending(ssl)) {
+    return;
+  }
+  evutil_socket_t fd = dup(bufferevent_getfd(old_bev));
+  if (fd < 0) {
+    return;
+  }
+  struct bufferevent* bev = bufferevent_socket_new(
+      bufferevent_get_base(old_bev), fd, BEV_OPT_CLOSE_ON_FREE);
+  if (bev == NULL) {
+    evutil_closesocket(fd);
+    return;
+  }
+  if (evbuffer_add_buffer(bufferevent_get_input(bev),
+      bufferevent_get_input(old_bev)) < 0) {
+    bufferevent_free(bev);
+    return;
+  }
+  bufferevent_set_timeouts(bev, conn->idle_timeout, NULL);
+  bufferevent_set_max_single_write(bev,
+      bufferevent_get_max_single_write(old_bev));
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  conn->bev = bev;
+  conn->record_sizing = 0;
+  conn->record_size = 0;
+  set_data_cbs(conn);
+  if (conn->group) {
+    conn->group->outputs[conn->group_index] = send_buffer(conn);
+    update_group(conn);
+  }
+  bufferevent_free(old_bev);
+  if (conn->direct_read) {
+    start_direct_read(conn);
+  } else if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
+    evwsconn_read_cb(bev, conn);
+  }
+#else
+  conn->ktls_pending = 0;
+#endif
+}
+
+void evwsconn_start_ktls(struct evwsconn* conn) {
+  struct bufferevent* bev = conn->bev;
+  if (!conn->ktls_pending || conn->freeing) {
+    return;
+  }
+  switch_to_ktls(conn);
+  if (!conn->ktls_pending && conn->bev == bev) {
+    set_data_cbs(conn);
+  }
+}
+
+static void evwsconn_write_cb(struct bufferevent *bev, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  evwsconn_start_ktls(conn);
+#ifdef EVWS_HAVE_ZEROCOPY
+  if (conn->zc != NULL && zc_drained(conn) < 0) {
+    ws_error(conn);
+    return;
+  }
+#endif
+  if (conn->queue) {
+    if (pace_output(conn) < 0) {
+      ws_error(conn);
+      return;
+    }
+    if (evbuffer_get_length(conn->queue) > 0 || zc_unsent(conn)) {
+      return;
+    }
+  }
+  if (conn->writable_cb && conn->alive && !conn->closing) {
+    conn->writable_cb(conn, conn->user_data);
+  }
+}
+
+// The write callback is only installed while something needs it
+static void set_data_cbs(struct evwsconn* conn) {
+  int want_write = conn->ktls_pending || conn->queue || conn->writable_cb;
+  bufferevent_setcb(conn->bev, evwsconn_read_cb,
+      want_write ? evwsconn_write_cb : NULL, evwsconn_event_cb, conn);
+}
+
+/*
+ * Zero-copy sends: on a plain socket with SO_ZEROCOPY, a message of at
+ * least the listener's threshold given to evwsconn_send_message_ref() is
+ * written with sendmsg(MSG_ZEROCOPY), so the kernel sends straight from the
+ * caller's memory.  Each successful call gets the next of the socket's
+ * sequence numbers, and the kernel reports ranges of them on the socket's
+ * error queue once it no longer needs the pages.  The message is held, and
+ * its cleanup callback not called, until all of its calls are reported.
+ *
+ * A message is only sent this way when nothing is waiting in the
+ * connection's queue.  If the bufferevent's output still holds data, the
+ * message waits for it to drain through the bufferevent's own writes, and
+ * is written from its write callback.  Until all of it has been written,
+ * anything sent after it waits in the connection's queue, and the writable
+ * callback is called from here once it has gone.
+ */
+struct evwszcsend {
+  struct evwszcsend* next;
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+  size_t header_len;
+  const unsigned char* data;
+  size_t len;
+  // bytes of the header and data written so far
+  size_t sent;
+  // the sequence numbers of the zero-copy writes, and how many are reported
+  uint32_t seq_first;
+  uint32_t seq_count;
+  uint32_t seq_done;
+  evws_cleanup_cb cleanup;
+  void* arg;
+};
+
+struct evwszerocopy {
+  size_t threshold;
+  struct event* err_ev;
+  struct event* write_ev;
+  // messages waiting for the kernel, oldest first
+  struct evwszcsend* head;
+  // the newest message, while not all of it has been written
+  struct evwszcsend* unsent;
+  uint32_t next_seq;
+  uint64_t bytes;
+  uint64_t copied;
+  // once the connection is freed, a duplicate of its socket, the base it
+  // holds a reference on and how often the error queue has been checked
+  int fd;
+  struct evwsbase* wsbase;
+  unsigned int checks;
+};
+
+static int zc_unsent(struct evwsconn* conn) {
+  return conn->zc != NULL && conn->zc->unsent != NULL;
+}
+
+/*
+ * Completions are only waited for while the connection is reading: with
+ * reading stopped, unread input would make the error queue's read event
+ * fire on every loop iteration.  Those that arrive meanwhile are picked up
+ * once reading resumes, or after the connection is freed.
+ */
+static void zc_poll(struct evwsconn* conn) {
+  struct evwszerocopy* zc = conn->zc;
+  if (zc == NULL) {
+    return;
+  }
+  if (zc->head != NULL && conn->alive && !conn->closing && !conn->rx_queued) {
+    event_add(zc->err_ev, NULL);
+  } else {
+    event_del(zc->err_ev);
+  }
+}
+
+#ifdef EVWS_HAVE_ZEROCOPY
+static void zc_release(struct evwszerocopy* zc, struct evwszcsend* send) {
+  struct evwszcsend** link = &zc->head;
+  while (*link != send) {
+    link = &(*link)->next;
+  }
+  *link = send->next;
+  if (send->cleanup) {
+    send->cleanup(send->data, send->len, send->arg);
+  }
+  evws_free(send);
+}
+
+static void zc_release_done(struct evwszerocopy* zc) {
+  struct evwszcsend* send = zc->head;
+  while (send != NULL) {
+    struct evwszcsend* next = send->next;
+    if (send->seq_done == send->seq_count && send != zc->unsent) {
+      zc_release(zc, send);
+    }
+    send = next;
+  }
+}
+
+// Sequence numbers wrap on long-lived connections, so they are compared by
+// their difference
+static int seq_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+// The kernel is done with the writes numbered lo to hi
+static void zc_complete(struct evwszerocopy* zc, uint32_t lo, uint32_t hi) {
+  struct evwszcsend* send = zc->head;
+  while (send != NULL) {
+    struct evwszcsend* next = send->next;
+    uint32_t first = seq_before(send->seq_first, lo) ? lo : send->seq_first;
+    uint32_t last = send->seq_first + send->seq_count - 1;
+    if (seq_before(hi, last)) {
+      last = hi;
+    }
+    if (send->seq_count > 0 && !seq_before(last, first)) {
+      send->seq_done += last - first + 1;
+      if (send->seq_done == send->seq_count && send != zc->unsent) {
+        zc_release(zc, send);
+      }
+    }
+    send = next;
+  }
+}
+
+// Read the completions waiting on the socket's error queue
+static void zc_reap(struct evwszerocopy* zc, int fd) {
+  for (;;) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+      break;
+    }
+    struct cmsghdr* cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err* err =
+          (struct sock_extended_err*)CMSG_DATA(cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zc->copied++;
+      }
+      zc_complete(zc, err->ee_info, err->ee_data);
+    }
+  }
+}
+
+static void zc_err_cb(evutil_socket_t fd, short events, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  zc_reap(conn->zc, fd);
+  zc_poll(conn);
+}
+
+// Write as much of the unsent message as the socket takes
+static int zc_write(struct evwsconn* conn) {
+  struct evwszerocopy* zc = conn->zc;
+  struct evwszcsend* send = zc->unsent;
+  int fd = bufferevent_getfd(conn->bev);
+  int flags = MSG_ZEROCOPY;
+  while (send->sent < send->header_len + send->len) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    if (send->sent < send->header_len) {
+      iov[0].iov_base = send->header + send->sent;
+      iov[0].iov_len = send->header_len - send->sent;
+      iov[1].iov_base = (void*)send->data;
+      iov[1].iov_len = send->len;
+      msg.msg_iovlen = 2;
+    } else {
+      iov[0].iov_base = (void*)(send->data + send->sent - send->header_len);
+      iov[0].iov_len = send->header_len + send->len - send->sent;
+      msg.msg_iovlen = 1;
+    }
+    ssize_t ret = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return event_add(zc->write_ev, NULL);
+      } else if (errno == ENOBUFS && flags != 0) {
+        flags = 0; // out of socket memory for notifications, copy instead
+        continue;
+      }
+      return -1;
+    }
+    if (flags != 0) {
+      if (send->seq_count == 0) {
+        send->seq_first = zc->next_seq;
+      }
+      zc->next_seq++;
+      send->seq_count++;
+      zc->bytes += ret;
+    }
+    send->sent += ret;
+  }
+  zc->unsent = NULL;
+  if (send->seq_done == send->seq_count) {
+    zc_release(zc, send);
+  }
+  return pace_output(conn);
+}
+
+static void zc_write_cb(evutil_socket_t fd, short events, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  if (zc_write(conn) < 0) {
+    ws_error(conn);
+  } else if (conn->zc->unsent == NULL && conn->writable_cb &&
+      conn->alive && !conn->closing && evbuffer_get_length(conn->queue) == 0 &&
+      evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+    conn->writable_cb(conn, conn->user_data);
+  }
+}
+
+// Whether a message can be sent with MSG_ZEROCOPY once the output drains
+static int zc_ready(struct evwsconn* conn) {
+  return conn->zc->unsent == NULL && !conn->closing &&
+      evbuffer_get_length(conn->queue) == 0;
+}
+
+// Write the waiting message once the bufferevent has written its output
+static int zc_drained(struct evwsconn* conn) {
+  if (!zc_unsent(conn) || conn->zc->unsent->sent > 0 ||
+      evbuffer_get_length(bufferevent_get_output(conn->bev)) > 0) {
+    return 0;
+  }
+  return zc_write(conn);
+}
+
+static int zc_send(struct evwsconn* conn, uint8_t opcode,
+    const unsigned char* data, size_t len, evws_cleanup_cb cleanup,
+    void* arg) {
+  struct evwszerocopy* zc = conn->zc;
+  struct evwszcsend* send =
+      (struct evwszcsend*)evws_malloc(sizeof(struct evwszcsend));
+  if (send == NULL) {
+    if (cleanup) {
+      cleanup(data, len, arg);
+    }
+    return -1;
+  }
+  memset(send, 0, sizeof(struct evwszcsend));
+  send->header_len = evws_frame_header(send->header, opcode, 1, len);
+  send->data = data;
+  send->len = len;
+  send->cleanup = cleanup;
+  send->arg = arg;
+  // keep the list in sending order, messages are rarely outstanding for long
+  struct evwszcsend** link = &zc->head;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  *link = send;
+  zc->unsent = send;
+  zc_poll(conn);
+  if (evbuffer_get_length(bufferevent_get_output(conn->bev)) > 0) {
+    return 0; // written by zc_drained() from the write callback
+  }
+  return zc_write(conn);
+}
+
+static void setup_zerocopy(struct evwsconn* conn, size_t threshold) {
+  int fd = bufferevent_getfd(conn->bev);
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+    return;
+  }
+  struct evwszerocopy* zc =
+      (struct evwszerocopy*)evws_malloc(sizeof(struct evwszerocopy));
+  if (zc == NULL) {
+    return;
+  }
+  memset(zc, 0, sizeof(struct evwszerocopy));
+  zc->threshold = threshold;
+  zc->fd = -1;
+  struct event_base* base = bufferevent_get_base(conn->bev);
+  // completions wake the socket with an error, which libevent reports to
+  // readers
+  zc->err_ev = event_new(base, fd, EV_READ|EV_PERSIST, zc_err_cb, conn);
+  zc->write_ev = event_new(base, fd, EV_WRITE, zc_write_cb, conn);
+  if (conn->queue == NULL) {
+    conn->queue = evbuffer_new();
+  }
+  if (zc->err_ev == NULL || zc->write_ev == NULL || conn->queue == NULL) {
+    if (zc->err_ev != NULL) {
+      event_free(zc->err_ev);
+    }
+    if (zc->write_ev != NULL) {
+      event_free(zc->write_ev);
+    }
+    evws_free(zc);
+    return;
+  }
+  conn->zc = zc;
+  set_data_cbs(conn);
+}
+
+// Release every message, once nothing can be sent from them any more
+static void free_zerocopy(struct evwszerocopy* zc) {
+  while (zc->head != NULL) {
+    struct evwszcsend* send = zc->head;
+    zc->head = send->next;
+    if (send->cleanup) {
+      send->cleanup(send->data, send->len, send->arg);
+    }
+    evws_free(send);
+  }
+  if (zc->err_ev != NULL) {
+    event_free(zc->err_ev);
+  }
+  event_free(zc->write_ev);
+  evws_free(zc);
+}
+
+// Reset the connection on close, dropping whatever is still unacknowledged
+static void zc_abort(int fd) {
+  struct linger linger = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+// How often a freed connection checks for completions, and for how long
+static const struct timeval zc_linger_interval = {0, 50000};
+#define ZC_LINGER_CHECKS 1200
+
+static void zc_linger_cb(evutil_socket_t fd, short events, void *zc_ptr) {
+  struct evwszerocopy* zc = (struct evwszerocopy *)zc_ptr;
+  zc_reap(zc, zc->fd);
+  if (zc->head != NULL && ++zc->checks < ZC_LINGER_CHECKS) {
+    evtimer_add(zc->write_ev, &zc_linger_interval);
+    return;
+  }
+  if (zc->head != NULL) {
+    zc_abort(zc->fd);
+  }
+  evutil_closesocket(zc->fd);
+  struct evwsbase* wsbase = zc->wsbase;
+  free_zerocopy(zc);
+  evwsbase_decref(wsbase);
+}
+
+/*
+ * The kernel sends and retransmits from the memory of zero-copy messages
+ * until the peer acknowledges it, which may be well after the connection is
+ * freed, so they can't simply be released then.  The socket is kept open on
+ * a duplicate descriptor, shut down for writing as closing it would have,
+ * and its error queue checked on a timer until the last completion.  The
+ * connection is reset if that takes too long, or if the socket can't be
+ * duplicated.  Whatever is left in conn->zc is freed after the socket is
+ * closed.
+ */
+static void linger_zerocopy(struct evwsconn* conn) {
+  struct evwszerocopy* zc = conn->zc;
+  int fd = bufferevent_getfd(conn->bev);
+  event_free(zc->err_ev);
+  zc->err_ev = NULL;
+  event_del(zc->write_ev);
+  zc->unsent = NULL; // the rest of it will never be sent
+  zc_reap(zc, fd);
+  zc_release_done(zc);
+  if (zc->head == NULL) {
+    return;
+  }
+  zc->fd = dup(fd);
+  if (zc->fd < 0) {
+    zc_abort(fd);
+    return;
+  }
+  shutdown(zc->fd, SHUT_WR);
+  event_assign(zc->write_ev, bufferevent_get_base(conn->bev), -1, 0,
+      zc_linger_cb, zc);
+  evtimer_add(zc->write_ev, &zc_linger_interval);
+  zc->wsbase = conn->wsbase;
+  evwsbase_incref(zc->wsbase);
+  conn->zc = NULL;
+}
+#endif
+
+/*
+ * io_uring: a plain connection on a listener with io_uring enabled receives
+ * and sends through its base's ring (see evws_uring.c) rather than through
+ * its bufferevent, which only keeps its buffers and callbacks.  A multishot
+ * receive stays armed while the connection is reading, and each of its
+ * completions is parsed straight out of the provided buffer it arrived in,
+ * so the socket is read without a syscall of its own.  What the read budget
+ * leaves unread is copied to the input buffer.  The output is moved to a
+ * buffer of its own just before each submission and sent with one send per
+ * chain, linked so that they go out in order, then drained once they have
+ * all completed.  The bufferevent's write callback is called then, as it
+ * would have been after a write that emptied the output.
+ *
+ * This state outlives the connection until each of its requests has
+ * completed, or until the ring is freed.
+ */
+#define URING_MAX_SENDS 16
+
+struct evwsconnuring {
+  // NULL once the connection has been freed
+  struct evwsconn* conn;
+  struct evwsuring* ring;
+  struct evwsuring_orphan orphan;
+  int fd;
+  struct evwsuring_op recv_op;
+  struct evwsuring_op send_op;
+  struct evbuffer_cb_entry* output_cb;
+  // the receive completion being parsed, and how much of it is left
+  const unsigned char* rx_data;
+  size_t rx_len;
+  // how receiving ended while reading was stopped by the read budget
+  short rx_end;
+  unsigned char rx_armed;
+  unsigned char rx_wanted;
+  unsigned char rx_cancelling;
+  // what is being sent, the sends in flight and what they have done
+  struct evbuffer* tx;
+  unsigned int tx_sends;
+  size_t tx_sent;
+  int tx_error;
+};
+
+static size_t uring_unsent(struct evwsconn* conn) {
+  return conn->uring != NULL ? evbuffer_get_length(conn->uring->tx) : 0;
+}
+
+static size_t uring_rx_len(struct evwsconn* conn) {
+  return conn->uring != NULL ? conn->uring->rx_len : 0;
+}
+
+static ssize_t uring_recv_copy(struct evwsconnuring* cu, uint8_t* buf,
+    size_t len) {
+  if (len > cu->rx_len) {
+    len = cu->rx_len;
+  }
+  memcpy(buf, cu->rx_data, len);
+  cu->rx_data += len;
+  cu->rx_len -= len;
+  return len;
+}
+
+#ifdef EVWS_HAVE_URING
+#define URING_OWNER(op, field) ((struct evwsconnuring*) \
+    ((char*)(op) - offsetof(struct evwsconnuring, field)))
+
+static void uring_free_orphan(struct evwsuring_orphan* orphan) {
+  struct evwsconnuring* cu = URING_OWNER(orphan, orphan);
+  evbuffer_free(cu->tx);
+  evws_free(cu);
+}
+
+static void uring_release(struct evwsconnuring* cu) {
+  if (cu->conn != NULL || cu->rx_armed || cu->tx_sends > 0 ||
+      cu->send_op.deferred) {
+    return;
+  }
+  evwsuring_disown(cu->ring, &cu->orphan);
+  uring_free_orphan(&cu->orphan);
+}
+
+static int uring_arm_recv(struct evwsconnuring* cu) {
+  struct io_uring_sqe* sqe = evwsuring_get_sqe(cu->ring, &cu->recv_op);
+  if (sqe == NULL) {
+    return -1;
+  }
+  evwsuring_prep_recv(cu->ring, sqe, cu->fd);
+  cu->rx_armed = 1;
+  return 0;
+}
+
+static void uring_recv_done(struct evwsuring_op* op, int res,
+    unsigned int flags) {
+  struct evwsconnuring* cu = URING_OWNER(op, recv_op);
+  struct evwsconn* conn = cu->conn;
+  short events = 0;
+  if (!(flags & IORING_CQE_F_MORE)) {
+    cu->rx_armed = 0;
+    cu->rx_cancelling = 0;
+  }
+  if (conn == NULL) {
+    evwsuring_recycle(cu->ring, flags);
+    uring_release(cu);
+    return;
+  }
+  if (res > 0) {
+    const unsigned char* data = evwsuring_buffer(cu->ring, flags);
+    size_t len = res;
+    if (cu->rx_wanted) {
+      cu->rx_data = data;
+      cu->rx_len = len;
+      evwsconn_read_cb(conn->bev, conn);
+      data = cu->rx_data;
+      len = cu->rx_len;
+      cu->rx_len = 0;
+    }
+    // the rest is read from the input once reading resumes.  A socket
+    // bufferevent keeps the end of its input frozen outside its own reads.
+    struct evbuffer* input = bufferevent_get_input(conn->bev);
+    evbuffer_unfreeze(input, 0);
+    if (len > 0 && evbuffer_add(input, data, len) < 0) {
+      events = BEV_EVENT_READING|BEV_EVENT_ERROR;
+    }
+    evbuffer_freeze(input, 0);
+    evwsuring_recycle(cu->ring, flags);
+  } else if (res == 0) {
+    events = BEV_EVENT_READING|BEV_EVENT_EOF;
+  } else if (res != -ENOBUFS && res != -ECANCELED) {
+    events = BEV_EVENT_READING|BEV_EVENT_ERROR;
+    errno = -res;
+  }
+  if (events != 0) {
+    if (conn->rx_queued) {
+      cu->rx_end = events;
+    } else if (cu->rx_wanted) {
+      cu->rx_wanted = 0;
+      evwsconn_event_cb(conn->bev, events, conn);
+    }
+    return;
+  }
+  if (!cu->rx_armed && cu->rx_wanted && uring_arm_recv(cu) < 0) {
+    cu->rx_wanted = 0;
+    evwsconn_event_cb(conn->bev, BEV_EVENT_READING|BEV_EVENT_ERROR, conn);
+  }
+}
+
+static void uring_recv_stop(struct evwsconn* conn) {
+  struct evwsconnuring* cu = conn->uring;
+  if (cu == NULL) {
+    return;
+  }
+  cu->rx_wanted = 0;
+  if (cu->rx_armed && !cu->rx_cancelling &&
+      evwsuring_cancel(cu->ring, &cu->recv_op) == 0) {
+    cu->rx_cancelling = 1;
+  }
+}
+
+// Receive again after the read budget, -1 if receiving has stopped for good
+static int uring_resume(struct evwsconn* conn) {
+  struct evwsconnuring* cu = conn->uring;
+  short events = cu->rx_end;
+  if (events != 0) {
+    cu->rx_end = 0;
+    evwsconn_event_cb(conn->bev, events, conn);
+    return -1;
+  }
+  cu->rx_wanted = 1;
+  // one still being cancelled is armed again once it has ended
+  if (!cu->rx_armed && uring_arm_recv(cu) < 0) {
+    cu->rx_wanted = 0;
+    evwsconn_event_cb(conn->bev, BEV_EVENT_READING|BEV_EVENT_ERROR, conn);
+    return -1;
+  }
+  return 0;
+}
+
+static void uring_output_cb(struct evbuffer* output,
+    const struct evbuffer_cb_info* info, void* cu_ptr) {
+  struct evwsconnuring* cu = (struct evwsconnuring*)cu_ptr;
+  if (info->n_added > 0) {
+    evwsuring_defer(cu->ring, &cu->send_op);
+  }
+}
+
+// Send what is in the output, unless the last sends have yet to complete
+static void uring_flush(struct evwsuring_op* op) {
+  struct evwsconnuring* cu = URING_OWNER(op, send_op);
+  struct evwsconn* conn = cu->conn;
+  struct evbuffer_iovec iov[URING_MAX_SENDS];
+  int n, i;
+  if (conn == NULL) {
+    uring_release(cu);
+    return;
+  }
+  if (cu->tx_sends > 0 || cu->tx_error != 0) {
+    return;
+  }
+  struct evbuffer* output = bufferevent_get_output(conn->bev);
+  evbuffer_unfreeze(output, 1);
+  int ret = evbuffer_add_buffer(cu->tx, output);
+  evbuffer_freeze(output, 1);
+  n = evbuffer_peek(cu->tx, -1, NULL, iov, URING_MAX_SENDS);
+  if (n > URING_MAX_SENDS) {
+    n = URING_MAX_SENDS;
+  }
+  if (ret < 0 || (n > 0 && evwsuring_reserve(cu->ring, n) < 0)) {
+    cu->tx_error = ENOMEM;
+    evwsconn_event_cb(conn->bev, BEV_EVENT_WRITING|BEV_EVENT_ERROR, conn);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    struct io_uring_sqe* sqe = evwsuring_get_sqe(cu->ring, &cu->send_op);
+    // MSG_WAITALL has a send wait for room for all of it; one that is
+    // still short cancels the rest of the chain, which is then resent
+    io_uring_prep_send(sqe, cu->fd, iov[i].iov_base, iov[i].iov_len,
+        MSG_NOSIGNAL|MSG_WAITALL);
+    if (i + 1 < n) {
+      io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    }
+  }
+  cu->tx_sends = n;
+}
+
+static void uring_send_done(struct evwsuring_op* op, int res,
+    unsigned int flags) {
+  struct evwsconnuring* cu = URING_OWNER(op, send_op);
+  struct evwsconn* conn = cu->conn;
+  cu->tx_sends--;
+  if (res > 0) {
+    cu->tx_sent += res;
+  } else if (res < 0 && res != -ECANCELED && cu->tx_error == 0) {
+    cu->tx_error = -res;
+  }
+  if (cu->tx_sends > 0) {
+    return;
+  }
+  if (conn == NULL) {
+    uring_release(cu);
+    return;
+  }
+  evbuffer_drain(cu->tx, cu->tx_sent);
+  cu->tx_sent = 0;
+  if (cu->tx_error != 0) {
+    // nothing more is sent
+    errno = cu->tx_error;
+    evwsconn_event_cb(conn->bev, BEV_EVENT_WRITING|BEV_EVENT_ERROR, conn);
+    return;
+  }
+  if (evbuffer_get_length(cu->tx) > 0 ||
+      evbuffer_get_length(bufferevent_get_output(conn->bev)) > 0) {
+    evwsuring_defer(cu->ring, &cu->send_op);
+    return;
+  }
+  bufferevent_data_cb write_cb;
+  void* arg;
+  bufferevent_getcb(conn->bev, NULL, &write_cb, NULL, &arg);
+  if (write_cb) {
+    write_cb(conn->bev, arg);
+  }
+}
+
+static void setup_uring(struct evwsconn* conn) {
+  struct evwsuring* ring = evwsuring_get(conn->wsbase);
+  if (ring == NULL) {
+    return;
+  }
+  struct evwsconnuring* cu =
+      (struct evwsconnuring*)evws_malloc(sizeof(struct evwsconnuring));
+  if (cu == NULL) {
+    return;
+  }
+  memset(cu, 0, sizeof(struct evwsconnuring));
+  cu->conn = conn;
+  cu->ring = ring;
+  cu->orphan.release = uring_free_orphan;
+  cu->fd = bufferevent_getfd(conn->bev);
+  cu->recv_op.complete = uring_recv_done;
+  cu->send_op.complete = uring_send_done;
+  cu->send_op.prepare = uring_flush;
+  struct evbuffer* output = bufferevent_get_output(conn->bev);
+  cu->tx = evbuffer_new();
+  if (cu->tx != NULL) {
+    cu->output_cb = evbuffer_add_cb(output, uring_output_cb, cu);
+  }
+  if (cu->output_cb == NULL || uring_arm_recv(cu) < 0) {
+    if (cu->output_cb != NULL) {
+      evbuffer_remove_cb_entry(output, cu->output_cb);
+    }
+    if (cu->tx != NULL) {
+      evbuffer_free(cu->tx);
+    }
+    evws_free(cu);
+    return;
+  }
+  cu->rx_wanted = 1;
+  conn->uring = cu;
+  bufferevent_disable(conn->bev, EV_READ|EV_WRITE);
+  if (evbuffer_get_length(output) > 0) {
+    evwsuring_defer(ring, &cu->send_op);
+  }
+}
+
+/*
+ * Whatever is still being received or sent is cancelled.  The requests are
+ * submitted now, while the descriptor they name is still open, as it may be
+ * reused by the next connection accepted once it is closed.
+ */
+static void free_uring(struct evwsconn* conn) {
+  struct evwsconnuring* cu = conn->uring;
+  conn->uring = NULL;
+  cu->conn = NULL;
+  evbuffer_remove_cb_entry(bufferevent_get_output(conn->bev), cu->output_cb);
+  if (cu->rx_armed && !cu->rx_cancelling) {
+    evwsuring_cancel(cu->ring, &cu->recv_op);
+  }
+  if (cu->tx_sends > 0) {
+    evwsuring_cancel(cu->ring, &cu->send_op);
+  }
+  evwsuring_submit(cu->ring);
+  evwsuring_adopt(cu->ring, &cu->orphan);
+  uring_release(cu);
+}
+#else
+static void uring_recv_stop(struct evwsconn* conn) {
+}
+
+static int uring_resume(struct evwsconn* conn) {
+  return 0;
+}
+#endif
+
+static ssize_t send_callback(wslay_event_context_ptr ctx, const uint8_t *data,
+    size_t len, int flags, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  struct evbuffer* output = send_buffer(conn);
+  if (conn->max_frame > 0) {
+    // wslay passes the header of each frame in a call of its own.  A close
+    // frame must still follow everything queued before it.
+    if (conn->tx_left == 0) {
+      uint8_t opcode = data[0] & 0x0f;
+      conn->tx_left = evws_frame_length(data, len);
+      conn->tx_urgent = (opcode == WSLAY_PING || opcode == WSLAY_PONG) &&
+          !zc_unsent(conn);
+    }
+    conn->tx_left -= len < conn->tx_left ? len : conn->tx_left;
+    if (conn->tx_urgent) {
+      output = bufferevent_get_output(conn->bev);
+      if (conn->record_sizing) {
+        size_records(conn, len);
+      }
+    }
+  }
+  if (conn->record_sizing && !conn->queue) {
+    size_records(conn, len);
+  }
+  if (evbuffer_add(output, data, len) < 0) {
+    wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+    return -1;
+  }
+  return len;
+}
+
+static ssize_t recv_callback(wslay_event_context_ptr ctx, uint8_t *buf,
+    size_t len, int flags, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  struct evbuffer* input = bufferevent_get_input(conn->bev);
+  int buffered = evbuffer_get_length(input) > 0;
+  ssize_t ret;
+  if (!buffered && conn->read_ev == NULL && uring_rx_len(conn) == 0) {
+    return 0;
+  }
+  if (!buffered && conn->rx_drained) {
+    // a short read emptied the socket, so another recv would only fail with
+    // EAGAIN; anything arriving since makes the read event fire again
+    wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+    return -1;
+  }
+  if (conn->rx_bytes_left == 0 || conn->rx_messages_left == 0) {
+    // the rest waits for this connection's turn on the ready queue
+    conn->rx_throttled = 1;
+    wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+    return -1;
+  }
+  if (len > conn->rx_bytes_left) {
+    len = conn->rx_bytes_left;
+  }
+  if (buffered) {
+    ret = evbuffer_remove(input, buf, len);
+  } else if (conn->uring != NULL) {
+    ret = uring_recv_copy(conn->uring, buf, len);
+  } else {
+    ret = recv(event_get_fd(conn->read_ev), buf, len, 0);
+    conn->rx_drained = ret > 0 && (size_t)ret < len;
+    if (ret == 0) {
+      conn->rx_events = BEV_EVENT_READING|BEV_EVENT_EOF;
+      ret = -1;
+    } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+        errno == EINTR)) {
+      wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+      return -1;
+    } else if (ret < 0) {
+      conn->rx_events = BEV_EVENT_READING|BEV_EVENT_ERROR;
+    }
+  }
+  if (ret < 0) {
+    wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+    return -1;
+  }
+  conn->rx_unparsed += ret;
+  conn->rx_bytes_left -= ret;
+  return ret;
+}
+
+/*
+ * Keep count of the received bytes wslay has not yet parsed, so that an
+ * idle connection knows whether its context can be freed.  Frames from a
+ * client are always masked, so the header length follows from the payload
+ * length.
+ */
+static void on_frame_recv_start_callback(wslay_event_context_ptr ctx,
+    const struct wslay_event_on_frame_recv_start_arg *arg, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  uint64_t header_len = 2 + 4;
+  if (arg->payload_length > 0xffff) {
+    header_len += 8;
+  } else if (arg->payload_length >= 126) {
+    header_len += 2;
+  }
+  conn->rx_unparsed -= header_len + arg->payload_length;
+  if (!wslay_is_ctrl_frame(arg->opcode)) {
+    conn->rx_in_message = !arg->fin;
+    if (arg->opcode != WSLAY_CONTINUATION_FRAME) {
+      conn->rx_opcode = arg->opcode;
+    }
+    conn->rx_frame = arg->fin ? RX_FRAME_LAST : RX_FRAME_DATA;
+  } else {
+    conn->rx_frame = RX_FRAME_CONTROL;
+  }
+}
+
+/*
+ * With a stream callback, wslay is set not to buffer data messages, and
+ * their payload is passed on as wslay unmasks it, a chunk at a time.  The
+ * end of the final frame of a message is reported with an empty chunk.
+ */
+static void on_frame_recv_chunk_callback(wslay_event_context_ptr ctx,
+    const struct wslay_event_on_frame_recv_chunk_arg *arg, void *conn_ptr) {
+  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
+  if (conn->stream_cb && conn->rx_frame != RX_FRAME_CONTROL &&
+      arg->data_length > 0) {
+    conn->stream_cb(conn, conn->rx_opcode == WSLAY_TEXT_FRAME ?
+        EVWS_DATA_TEXT : EVWS_DATA_BINARY, arg->data, arg->data_length, 0,
+        conn->user_data);
   }
 }
 
-static void evwsconn_read_cb(struct bufferevent *bev, void *conn_ptr) {
+static void on_frame_recv_end_callback(wslay_event_context_ptr ctx,
+    void *conn_ptr) {
   struct evwsconn *conn = (struct evwsconn *)conn_ptr;
-  int ret;
-  if ((ret = wslay_event_recv(conn->ctx)) < 0) {
-    ws_error(conn);
+  if (conn->rx_frame != RX_FRAME_LAST) {
     return;
   }
-  evwsconn_do_write(conn);
+  if (conn->rx_messages_left > 0) {
+    conn->rx_messages_left--;
+  }
+  if (conn->stream_cb) {
+    conn->stream_cb(conn, conn->rx_opcode == WSLAY_TEXT_FRAME ?
+        EVWS_DATA_TEXT : EVWS_DATA_BINARY, NULL, 0, 1, conn->user_data);
+  }
 }
 
-static ssize_t send_callback(wslay_event_context_ptr ctx, const uint8_t *data,
-    size_t len, int flags, void *conn_ptr) {
-  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
-  struct evbuffer* output = bufferevent_get_output(conn->bev);
-  if (evbuffer_add(output, data, len) < 0) {
-    wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
-    return -1;
+/*
+ * wslay frees each message once on_msg_recv_callback returns, so for a
+ * batch callback the messages received during one read are copied into
+ * buffers kept on the base, which are reused from one read to the next.
+ * The data pointers are only filled in once the batch is complete, as the
+ * data buffer may move while it grows.
+ */
+static int batch_add(struct evwsbase* wsbase, enum evws_data_type data_type,
+    const uint8_t* data, size_t len) {
+  if (wsbase->batch_len == wsbase->batch_size) {
+    size_t size = wsbase->batch_size ? wsbase->batch_size * 2 : 64;
+    struct evws_msg* msgs = (struct evws_msg*)evws_realloc(wsbase->batch_msgs,
+        size * sizeof(struct evws_msg));
+    if (msgs == NULL) {
+      return -1;
+    }
+    wsbase->batch_msgs = msgs;
+    wsbase->batch_size = size;
   }
-  return len;
+  if (wsbase->batch_data_size - wsbase->batch_data_len < len) {
+    size_t size = wsbase->batch_data_size ? wsbase->batch_data_size * 2 :
+        4096;
+    if (size < wsbase->batch_data_len + len) {
+      size = wsbase->batch_data_len + len;
+    }
+    unsigned char* batch_data = (unsigned char*)evws_realloc(
+        wsbase->batch_data, size);
+    if (batch_data == NULL) {
+      return -1;
+    }
+    wsbase->batch_data = batch_data;
+    wsbase->batch_data_size = size;
+  }
+  memcpy(wsbase->batch_data + wsbase->batch_data_len, data, len);
+  wsbase->batch_data_len += len;
+  struct evws_msg* msg = &wsbase->batch_msgs[wsbase->batch_len++];
+  msg->data_type = data_type;
+  msg->data = NULL;
+  msg->len = len;
+  return 0;
 }
 
-static ssize_t recv_callback(wslay_event_context_ptr ctx, uint8_t *buf,
-    size_t len, int flags, void *conn_ptr) {
-  struct evwsconn *conn = (struct evwsconn *)conn_ptr;
-  struct evbuffer* input = bufferevent_get_input(conn->bev);
-  int ret = evbuffer_remove(input, buf, len);
-  if (ret < 0) {
-    wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
-    return -1;
+static void deliver_batch(struct evwsconn* conn) {
+  struct evwsbase* wsbase = conn->wsbase;
+  size_t n = wsbase->batch_len;
+  if (n == 0) {
+    return;
+  }
+  wsbase->batch_len = 0;
+  wsbase->batch_data_len = 0;
+  const unsigned char* data = wsbase->batch_data;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    wsbase->batch_msgs[i].data = data;
+    data += wsbase->batch_msgs[i].len;
+  }
+  if (conn->batch_cb) {
+    conn->batch_cb(conn, wsbase->batch_msgs, n, conn->user_data);
   }
-  return ret;
 }
 
 static void on_msg_recv_callback(wslay_event_context_ptr ctx,
     const struct wslay_event_on_msg_recv_arg *arg, void *conn_ptr) {
   struct evwsconn *conn = (struct evwsconn *)conn_ptr;
-  if(!wslay_is_ctrl_frame(arg->opcode)) {
-    if (conn->message_cb) {
+  // Without buffering, wslay still reports the end of each data message,
+  // with no data, after its frames have gone to the stream callback
+  if(!wslay_is_ctrl_frame(arg->opcode) && !conn->stream_cb) {
+    if (conn->message_cb || conn->batch_cb) {
       enum evws_data_type data_type;
       switch(arg->opcode) {
       case WSLAY_TEXT_FRAME: data_type = EVWS_DATA_TEXT; break;
@@ -130,15 +1589,23 @@ static void on_msg_recv_callback(wslay_event_context_ptr ctx,
         exit(-1);
         break;
       }
-      conn->message_cb(conn, data_type, arg->msg, arg->msg_length,
-          conn->user_data);
+      if (!conn->batch_cb) {
+        conn->message_cb(conn, data_type, arg->msg, arg->msg_length,
+            conn->user_data);
+      } else if (batch_add(conn->wsbase, data_type, arg->msg,
+          arg->msg_length) < 0) {
+        // out of memory: deliver what there is, then this message by itself
+        deliver_batch(conn);
+        struct evws_msg msg = {data_type, arg->msg, arg->msg_length};
+        if (conn->batch_cb) {
+          conn->batch_cb(conn, &msg, 1, conn->user_data);
+        }
+      }
     }
   }
 }
 
-static void internal_evwsconn_free(evutil_socket_t sock, short events,
-    void* conn_ptr) {
-  struct evwsconn* conn = (struct evwsconn*)conn_ptr;
+static void internal_evwsconn_free(struct evwsconn* conn) {
   SSL *ctx = bufferevent_openssl_get_ssl(conn->bev);
   if (ctx != NULL) {
     /*
@@ -155,26 +1622,249 @@ static void internal_evwsconn_free(evutil_socket_t sock, short events,
     SSL_set_shutdown(ctx, SSL_RECEIVED_SHUTDOWN);
     SSL_shutdown(ctx);
   }
+  if (conn->read_ev != NULL) {
+    event_free(conn->read_ev);
+  }
+  if (conn->rx_queued) {
+    unqueue_ready(conn);
+  }
+#ifdef EVWS_HAVE_ZEROCOPY
+  if (conn->zc != NULL) {
+    linger_zerocopy(conn);
+  }
+#endif
+#ifdef EVWS_HAVE_URING
+  if (conn->uring != NULL) {
+    free_uring(conn);
+  }
+#endif
   bufferevent_free(conn->bev);
-  wslay_event_context_free(conn->ctx);
-  free(conn);
+#ifdef EVWS_HAVE_ZEROCOPY
+  if (conn->zc != NULL) {
+    free_zerocopy(conn->zc);
+  }
+#endif
+  if (conn->ctx != NULL) {
+    wslay_event_context_free(conn->ctx);
+  }
+  if (conn->queue != NULL) {
+    evbuffer_free(conn->queue);
+  }
+  struct evwsbase* wsbase = conn->wsbase;
+  evws_pool_free(conn->pool, conn);
+  evwsbase_decref(wsbase);
+}
+
+/*
+ * Connections are not freed from within evwsconn_free() since that is
+ * usually called from one of the connection's own callbacks.  Instead they
+ * are queued on the base and freed together once per loop iteration.
+ */
+static void free_queued_conns(evutil_socket_t sock, short events,
+    void* wsbase_ptr) {
+  struct evwsbase* wsbase = (struct evwsbase*)wsbase_ptr;
+  // Each connection holds a reference on the base, hold one more so that
+  // freeing the last connection doesn't free the base from under us
+  evwsbase_incref(wsbase);
+  struct evwsconn* head = wsbase->free_head;
+  wsbase->free_head = NULL;
+  while (head) {
+    struct evwsconn* conn = head;
+    head = conn->next_free;
+    internal_evwsconn_free(conn);
+  }
+  evwsbase_decref(wsbase);
+}
+
+static void queue_free(struct evwsconn* conn) {
+  struct evwsbase* wsbase = conn->wsbase;
+  if (wsbase->free_head == NULL) {
+    event_active(wsbase->free_ev, EV_TIMEOUT, 0);
+  }
+  conn->next_free = wsbase->free_head;
+  wsbase->free_head = conn;
+}
+
+int evwsconn_init_base(struct evwsbase* wsbase) {
+  wsbase->free_ev = event_new(wsbase->base, -1, 0, free_queued_conns, wsbase);
+  wsbase->ready_ev = event_new(wsbase->base, -1, 0, read_ready_conns,
+      wsbase);
+  if (wsbase->free_ev == NULL || wsbase->ready_ev == NULL) {
+    if (wsbase->free_ev != NULL) {
+      event_free(wsbase->free_ev);
+    }
+    if (wsbase->ready_ev != NULL) {
+      event_free(wsbase->ready_ev);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+// The user area follows the connection, aligned as malloc would align it
+#define USERDATA_ALIGN 16
+#define USERDATA_OFFSET \
+  ((sizeof(struct evwsconn) + USERDATA_ALIGN - 1) & \
+      ~(size_t)(USERDATA_ALIGN - 1))
+
+size_t evwsconn_alloc_size(const struct evwsconn_config* config) {
+  if (config->userdata_size == 0) {
+    return sizeof(struct evwsconn);
+  }
+  return USERDATA_OFFSET + config->userdata_size;
 }
 
-struct evwsconn* evwsconn_new(struct bufferevent* bev,
-    const char* subprotocol) {
-  struct evwsconn *conn = (struct evwsconn *)malloc(sizeof(struct evwsconn));
-  memset(conn, 0, sizeof(struct evwsconn));
+struct evwsconn* evwsconn_new(struct evwsbase* wsbase, struct bufferevent* bev,
+    const char* subprotocol, const struct evwsconn_config* config) {
+  size_t size = evwsconn_alloc_size(config);
+  struct evws_pool* pool = evwsbase_get_pool(wsbase, size, EVWSCONN_ALIGN);
+  if (pool == NULL) {
+    return NULL;
+  }
+  struct evwsconn *conn = (struct evwsconn *)evws_pool_alloc(pool);
+  if (conn == NULL) {
+    return NULL;
+  }
+  memset(conn, 0, size);
+  if (ensure_ctx(conn) < 0) {
+    evws_pool_free(pool, conn);
+    return NULL;
+  }
+  evwsbase_incref(wsbase);
+  conn->wsbase = wsbase;
+  conn->pool = pool;
   conn->alive = 1;
+  conn->has_userdata = config->userdata_size != 0;
   conn->bev = bev;
-  bufferevent_setcb(conn->bev, evwsconn_read_cb, NULL, evwsconn_event_cb,
-      conn);
-  struct wslay_event_callbacks callbacks = {recv_callback, send_callback,
-      NULL, NULL, NULL, NULL, on_msg_recv_callback};
-  wslay_event_context_server_init(&conn->ctx, &callbacks, conn);
+  conn->ktls_pending = config->ktls &&
+      bufferevent_openssl_get_ssl(bev) != NULL;
+  if (config->notsent_lowat > 0 || config->max_frame_size > 0) {
+    conn->queue = evbuffer_new();
+    if (conn->queue == NULL) {
+      wslay_event_context_free(conn->ctx);
+      evws_pool_free(pool, conn);
+      evwsbase_decref(wsbase);
+      return NULL;
+    }
+    conn->max_frame = config->max_frame_size;
+  }
+  if (config->notsent_lowat > 0) {
+    conn->notsent_lowat = config->notsent_lowat;
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = config->notsent_lowat;
+    setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+        &lowat, sizeof(lowat));
+#endif
+  }
+  if (config->write_budget > 0) {
+    bufferevent_set_max_single_write(bev, config->write_budget);
+  }
+  conn->read_budget_bytes = config->read_budget_bytes;
+  conn->read_budget_messages = config->read_budget_messages;
+  set_data_cbs(conn);
+  if (config->tls_record_sizing && bufferevent_openssl_get_ssl(bev) != NULL) {
+    conn->record_sizing = 1;
+    conn->record_size = FULL_RECORD_SIZE; // OpenSSL's default
+  }
+  if (config->idle_timeout != NULL) {
+    conn->idle_timeout = config->idle_timeout;
+    bufferevent_set_timeouts(bev, conn->idle_timeout, NULL);
+  }
+#ifdef EVWS_HAVE_URING
+  if (config->io_uring && bufferevent_openssl_get_ssl(bev) == NULL) {
+    setup_uring(conn);
+  }
+#endif
+#ifdef EVWS_HAVE_ZEROCOPY
+  if (config->zerocopy_threshold > 0 && conn->uring == NULL &&
+      bufferevent_openssl_get_ssl(bev) == NULL) {
+    setup_zerocopy(conn, config->zerocopy_threshold);
+  }
+#endif
   conn->subprotocol = subprotocol;
+  conn->direct_read = config->direct_read;
+  start_direct_read(conn);
   return conn;
 }
 
+static int ensure_ctx(struct evwsconn* conn) {
+  if (conn->ctx != NULL) {
+    return 0;
+  }
+  struct wslay_event_callbacks callbacks = {recv_callback, send_callback,
+      NULL, on_frame_recv_start_callback, on_frame_recv_chunk_callback,
+      on_frame_recv_end_callback, on_msg_recv_callback};
+  conn->rx_unparsed = 0;
+  conn->rx_in_message = 0;
+  if (wslay_event_context_server_init(&conn->ctx, &callbacks, conn) != 0) {
+    return -1;
+  }
+  if (conn->stream_cb) {
+    wslay_event_config_set_no_buffering(conn->ctx, 1);
+  }
+  return 0;
+}
+
+void evws_sockopts_init(struct evws_sockopts *opts) {
+  int i;
+  for (i = 0; i < EVWS_SOCKOPT_MAX; i++) {
+    opts->values[i] = -1;
+  }
+}
+
+static int set_sockopt(int fd, enum evws_sockopt opt, int value) {
+  int level = IPPROTO_TCP;
+  int name;
+  switch (opt) {
+  case EVWS_SOCKOPT_NODELAY: name = TCP_NODELAY; break;
+  case EVWS_SOCKOPT_SNDBUF: level = SOL_SOCKET; name = SO_SNDBUF; break;
+  case EVWS_SOCKOPT_RCVBUF: level = SOL_SOCKET; name = SO_RCVBUF; break;
+#ifdef TCP_USER_TIMEOUT
+  case EVWS_SOCKOPT_USER_TIMEOUT: name = TCP_USER_TIMEOUT; break;
+#endif
+  case EVWS_SOCKOPT_KEEPALIVE: level = SOL_SOCKET; name = SO_KEEPALIVE; break;
+#ifdef TCP_KEEPIDLE
+  case EVWS_SOCKOPT_KEEPIDLE: name = TCP_KEEPIDLE; break;
+  case EVWS_SOCKOPT_KEEPINTVL: name = TCP_KEEPINTVL; break;
+  case EVWS_SOCKOPT_KEEPCNT: name = TCP_KEEPCNT; break;
+#endif
+  case EVWS_SOCKOPT_TOS: {
+    struct sockaddr_storage address;
+    socklen_t socklen = sizeof(address);
+    if (getsockname(fd, (struct sockaddr *)&address, &socklen) < 0) {
+      return -1;
+    }
+    if (address.ss_family == AF_INET6) {
+      level = IPPROTO_IPV6;
+      name = IPV6_TCLASS;
+    } else {
+      level = IPPROTO_IP;
+      name = IP_TOS;
+    }
+    break;
+  }
+  default:
+    return -1;
+  }
+  return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+int evws_apply_sockopts(int fd, const struct evws_sockopts* opts) {
+  int ret = 0;
+  int i;
+  for (i = 0; i < EVWS_SOCKOPT_MAX; i++) {
+    if (opts->values[i] != -1 && set_sockopt(fd, i, opts->values[i]) < 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int evwsconn_set_sockopt(struct evwsconn *conn, enum evws_sockopt opt,
+    int value) {
+  return set_sockopt(bufferevent_getfd(conn->bev), opt, value);
+}
+
 struct bufferevent* evwsconn_get_bufferevent(struct evwsconn *conn) {
   return conn->bev;
 }
@@ -183,15 +1873,63 @@ const char* evwsconn_get_subprotocol(struct evwsconn *conn) {
   return conn->subprotocol;
 }
 
+void evwsconn_get_stats(struct evwsconn *conn, struct evwsconn_stats *stats) {
+  memset(stats, 0, sizeof(struct evwsconn_stats));
+  stats->tls_record_size = conn->record_size;
+  stats->small_record_bytes = conn->small_record_bytes;
+  stats->full_record_bytes = conn->full_record_bytes;
+  stats->idle_compactions = conn->compactions;
+  stats->compacted = conn->ctx == NULL;
+  stats->queued_bytes = conn->queue ? evbuffer_get_length(conn->queue) : 0;
+  if (conn->zc != NULL) {
+    stats->zerocopy_bytes = conn->zc->bytes;
+    stats->zerocopy_copied = conn->zc->copied;
+  }
+  stats->read_throttles = conn->read_throttles;
+}
+
+void* evwsconn_get_userdata_area(struct evwsconn *conn) {
+  if (!conn->has_userdata) {
+    return NULL;
+  }
+  return (char*)conn + USERDATA_OFFSET;
+}
+
 void evwsconn_free(struct evwsconn* conn) {
-  if (conn == NULL) {
+  if (conn == NULL || conn->freeing) {
     return;
   }
+  conn->freeing = 1;
   conn->message_cb = NULL;
   conn->close_cb = NULL;
   conn->error_cb = NULL;
-  event_base_once(bufferevent_get_base(conn->bev), -1, EV_TIMEOUT,
-      &internal_evwsconn_free, conn, NULL);
+  conn->batch_cb = NULL;
+  conn->stream_cb = NULL;
+  if (conn->group) {
+    evwsconngroup_remove(conn->group, conn);
+  }
+  queue_free(conn);
+}
+
+void evwsconn_set_writable_cb(struct evwsconn *conn,
+    evwsconn_writable_cb writable_cb) {
+  conn->writable_cb = writable_cb;
+  if (!conn->closing) {
+    set_data_cbs(conn);
+  }
+}
+
+void evwsconn_set_batch_cb(struct evwsconn *conn,
+    evwsconn_batch_cb batch_cb) {
+  conn->batch_cb = batch_cb;
+}
+
+void evwsconn_set_stream_cb(struct evwsconn *conn,
+    evwsconn_stream_cb stream_cb) {
+  conn->stream_cb = stream_cb;
+  if (conn->ctx != NULL) {
+    wslay_event_config_set_no_buffering(conn->ctx, stream_cb != NULL);
+  }
 }
 
 void evwsconn_set_cbs(struct evwsconn *conn, evwsconn_message_cb message_cb,
@@ -203,28 +1941,454 @@ void evwsconn_set_cbs(struct evwsconn *conn, evwsconn_message_cb message_cb,
   conn->user_data = user_data;
 }
 
+/*
+ * Split a message larger than the maximum frame size into continuation
+ * frames.  They are built in a buffer of their own and then moved to the
+ * queue in one go, so that on failure nothing is left half sent, and
+ * cleanup is called exactly once: by libevent once the last frame is
+ * drained, or here if it was never added.
+ */
+static int send_fragments(struct evwsconn* conn, uint8_t opcode,
+    const unsigned char* data, size_t len, evws_cleanup_cb cleanup,
+    void* arg) {
+  struct evbuffer* frames = evbuffer_new();
+  size_t offset = 0;
+  while (frames != NULL && offset < len) {
+    size_t n = len - offset;
+    if (n > conn->max_frame) {
+      n = conn->max_frame;
+    }
+    int fin = offset + n == len;
+    unsigned char header[EVWS_FRAME_HEADER_MAX];
+    size_t header_len = evws_frame_header(header,
+        offset == 0 ? opcode : WSLAY_CONTINUATION_FRAME, fin, n);
+    int ret = evbuffer_add(frames, header, header_len);
+    if (ret == 0 && cleanup != NULL) {
+      ret = evbuffer_add_reference(frames, data + offset, n,
+          fin ? cleanup : NULL, arg);
+    } else if (ret == 0) {
+      ret = evbuffer_add(frames, data + offset, n);
+    }
+    if (ret < 0) {
+      evbuffer_free(frames);
+      frames = NULL;
+    }
+    offset += n;
+  }
+  if (frames == NULL) {
+    if (cleanup) {
+      cleanup(data, len, arg);
+    }
+    return -1;
+  }
+  int ret = evbuffer_add_buffer(conn->queue, frames);
+  evbuffer_free(frames);
+  return ret < 0 || pace_output(conn) < 0 ? -1 : 0;
+}
+
 void evwsconn_send_message(struct evwsconn *conn, enum evws_data_type data_type,
     const unsigned char* data, int len) {
-  if (!conn->alive) {
+  if (!conn->alive || conn->closing) {
+    return;
+  }
+  if (conn->max_frame > 0 && (size_t)len > conn->max_frame) {
+    if (send_fragments(conn, data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME :
+        WSLAY_BINARY_FRAME, data, len, NULL, NULL) < 0) {
+      ws_error(conn);
+    }
     return;
   }
   struct wslay_event_msg msg = {
       data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME,
       data, len};
-  if (wslay_event_queue_msg(conn->ctx, &msg) < 0) {
+  if (ensure_ctx(conn) < 0 || wslay_event_queue_msg(conn->ctx, &msg) < 0) {
     ws_error(conn);
     return;
   }
   evwsconn_do_write(conn);
 }
 
+int evwsconn_send_message_ref(struct evwsconn *conn,
+    enum evws_data_type data_type, const unsigned char* data, size_t len,
+    evws_cleanup_cb cleanup, void* arg) {
+  // nothing may follow the close frame
+  if (!conn->alive || conn->closing) {
+    if (cleanup) {
+      cleanup(data, len, arg);
+    }
+    return -1;
+  }
+  uint8_t opcode =
+      data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME;
+  if (conn->max_frame > 0 && len > conn->max_frame) {
+    if (send_fragments(conn, opcode, data, len, cleanup, arg) < 0) {
+      ws_error(conn);
+      return -1;
+    }
+    return 0;
+  }
+#ifdef EVWS_HAVE_ZEROCOPY
+  if (conn->zc != NULL && len >= conn->zc->threshold && zc_ready(conn)) {
+    if (zc_send(conn, opcode, data, len, cleanup, arg) < 0) {
+      ws_error(conn);
+      return -1;
+    }
+    return 0;
+  }
+#endif
+  // As with broadcasts, the frame can go straight after whatever wslay has
+  // sent, and libevent references the data rather than copying it
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+  size_t header_len = evws_frame_header(header, opcode, 1, len);
+  struct evbuffer* output = send_buffer(conn);
+  if (conn->record_sizing && !conn->queue) {
+    size_records(conn, header_len + len);
+  }
+  if (evbuffer_add(output, header, header_len) < 0) {
+    if (cleanup) {
+      cleanup(data, len, arg);
+    }
+    ws_error(conn);
+    return -1;
+  }
+  if (evbuffer_add_reference(output, data, len, cleanup, arg) < 0) {
+    if (cleanup) {
+      cleanup(data, len, arg);
+    }
+    ws_error(conn);
+    return -1;
+  }
+  if (conn->queue && pace_output(conn) < 0) {
+    ws_error(conn);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * A file segment is sent with sendfile() when the buffer it is added to
+ * drains straight to a socket, i.e. the output of a plain or kTLS
+ * connection.  Over OpenSSL, and in a connection's queue, libevent maps the
+ * file into memory instead, so it still isn't read into a copy of its own.
+ */
+int evwsconn_send_file(struct evwsconn *conn, int fd, int64_t offset,
+    int64_t len) {
+  if (!conn->alive || conn->closing || offset < 0 || len < 0) {
+    close(fd);
+    return -1;
+  }
+  // the ring sends from memory, so the file is mapped rather than sent with
+  // sendfile()
+  struct evbuffer_file_segment* seg = evbuffer_file_segment_new(fd, offset,
+      len, EVBUF_FS_CLOSE_ON_FREE |
+      (conn->uring != NULL ? EVBUF_FS_DISABLE_SENDFILE : 0));
+  if (seg == NULL) {
+    close(fd);
+    return -1;
+  }
+  // As with send_fragments(), a file larger than the maximum frame size is
+  // split into continuation frames, built in a buffer of their own so that
+  // nothing is left half sent on failure.  The buffer holds its own
+  // reference on the segment for each frame added.
+  struct evbuffer* frames = evbuffer_new();
+  int ret = frames != NULL ? 0 : -1;
+  int64_t pos = 0;
+  while (ret == 0) {
+    int64_t n = len - pos;
+    if (conn->max_frame > 0 && (uint64_t)n > conn->max_frame) {
+      n = conn->max_frame;
+    }
+    unsigned char header[EVWS_FRAME_HEADER_MAX];
+    size_t header_len = evws_frame_header(header,
+        pos == 0 ? WSLAY_BINARY_FRAME : WSLAY_CONTINUATION_FRAME,
+        pos + n == len, n);
+    ret = evbuffer_add(frames, header, header_len) < 0 ||
+        evbuffer_add_file_segment(frames, seg, pos, n) < 0 ? -1 : 0;
+    pos += n;
+    if (pos == len) {
+      break;
+    }
+  }
+  evbuffer_file_segment_free(seg);
+  if (ret == 0) {
+    if (conn->record_sizing && !conn->queue) {
+      size_records(conn, evbuffer_get_length(frames));
+    }
+    ret = evbuffer_add_buffer(send_buffer(conn), frames);
+  }
+  if (frames != NULL) {
+    evbuffer_free(frames);
+  }
+  if (ret < 0 || (conn->queue && pace_output(conn) < 0)) {
+    ws_error(conn);
+    return -1;
+  }
+  return 0;
+}
+
+static void buf_cleanup(const void* data, size_t len, void* buf) {
+  evwsbuf_decref((struct evwsbuf*)buf);
+}
+
+int evwsconn_send_buf(struct evwsconn *conn, enum evws_data_type data_type,
+    struct evwsbuf *buf) {
+  evwsbuf_incref(buf);
+  return evwsconn_send_message_ref(conn, data_type, evwsbuf_data(buf),
+      evwsbuf_len(buf), buf_cleanup, buf);
+}
+
+/*
+ * All of the frames are built in one extent of the send buffer, so a batch
+ * costs one append and one pass through pacing and record sizing however
+ * many messages it holds.  As with broadcasts, wslay is bypassed.
+ */
+int evwsconn_send_messages(struct evwsconn *conn,
+    const struct evws_msg *msgs, size_t n) {
+  if (!conn->alive || conn->closing) {
+    return -1;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  size_t total = 0;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char header[EVWS_FRAME_HEADER_MAX];
+    total += evws_frame_header(header, WSLAY_BINARY_FRAME, 1, msgs[i].len) +
+        msgs[i].len;
+  }
+  struct evbuffer* output = send_buffer(conn);
+  struct evbuffer_iovec vec;
+  if (evbuffer_reserve_space(output, total, &vec, 1) != 1) {
+    ws_error(conn);
+    return -1;
+  }
+  unsigned char* p = (unsigned char*)vec.iov_base;
+  for (i = 0; i < n; i++) {
+    p += evws_frame_header(p, msgs[i].data_type == EVWS_DATA_TEXT ?
+        WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME, 1, msgs[i].len);
+    memcpy(p, msgs[i].data, msgs[i].len);
+    p += msgs[i].len;
+  }
+  vec.iov_len = total;
+  if (conn->record_sizing && !conn->queue) {
+    size_records(conn, total);
+  }
+  if (evbuffer_commit_space(output, &vec, 1) < 0 ||
+      (conn->queue && pace_output(conn) < 0)) {
+    ws_error(conn);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The space is reserved with room for the header that max_len would need.
+ * Frame lengths must be encoded in as few bytes as possible, so if the
+ * message turns out to need a shorter header, the payload is moved back to
+ * meet it.  That only happens to copy more than 125 bytes when max_len is
+ * at least 64 KB and the message is shorter.
+ */
+unsigned char* evwsconn_reserve(struct evwsconn *conn, size_t max_len) {
+  if (!conn->alive || conn->closing) {
+    return NULL;
+  }
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+  size_t header_len = evws_frame_header(header, WSLAY_BINARY_FRAME, 1,
+      max_len);
+  struct evbuffer* output = send_buffer(conn);
+  struct evbuffer_iovec vec;
+  if (evbuffer_reserve_space(output, header_len + max_len, &vec, 1) != 1) {
+    return NULL;
+  }
+  conn->reserved_buf = output;
+  conn->reserved = (unsigned char*)vec.iov_base;
+  conn->reserved_len = max_len;
+  return conn->reserved + header_len;
+}
+
+int evwsconn_commit(struct evwsconn *conn, enum evws_data_type data_type,
+    size_t used) {
+  unsigned char* base = conn->reserved;
+  if (base == NULL || used > conn->reserved_len) {
+    return -1;
+  }
+  conn->reserved = NULL;
+  if (!conn->alive || conn->closing) {
+    return -1;
+  }
+  uint8_t opcode =
+      data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME;
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+  size_t reserved_header = evws_frame_header(header, opcode, 1,
+      conn->reserved_len);
+  size_t header_len = evws_frame_header(header, opcode, 1, used);
+  if (header_len < reserved_header) {
+    memmove(base + header_len, base + reserved_header, used);
+  }
+  memcpy(base, header, header_len);
+  struct evbuffer_iovec vec;
+  vec.iov_base = base;
+  vec.iov_len = header_len + used;
+  if (conn->record_sizing && !conn->queue) {
+    size_records(conn, vec.iov_len);
+  }
+  // fails if anything else was added to the buffer since the reservation
+  if (evbuffer_commit_space(conn->reserved_buf, &vec, 1) < 0 ||
+      (conn->queue && pace_output(conn) < 0)) {
+    ws_error(conn);
+    return -1;
+  }
+  return 0;
+}
+
 void evwsconn_send_close(struct evwsconn *conn) {
   if (!conn->alive) {
     return;
   }
-  if (wslay_event_queue_close(conn->ctx, 0, NULL, 0) < 0) {
+  if (ensure_ctx(conn) < 0 ||
+      wslay_event_queue_close(conn->ctx, 0, NULL, 0) < 0) {
     ws_error(conn);
     return;
   }
+  conn->closing = 1;
+  update_group(conn);
   evwsconn_do_write(conn);
 }
+
+struct evwsconngroup* evwsconngroup_new(void) {
+  struct evwsconngroup* group =
+      (struct evwsconngroup*)evws_malloc(sizeof(struct evwsconngroup));
+  if (group == NULL) {
+    return NULL;
+  }
+  memset(group, 0, sizeof(struct evwsconngroup));
+  return group;
+}
+
+void evwsconngroup_free(struct evwsconngroup* group) {
+  if (group == NULL) {
+    return;
+  }
+  size_t i;
+  for (i = 0; i < group->size; i++) {
+    group->conns[i]->group = NULL;
+  }
+  evws_free(group->conns);
+  evws_free(group->outputs);
+  evws_free(group->flags);
+  evws_free(group);
+}
+
+static int group_reserve(struct evwsconngroup* group, size_t capacity) {
+  struct evwsconn** conns = (struct evwsconn**)evws_realloc(group->conns,
+      capacity * sizeof(struct evwsconn*));
+  if (conns == NULL) {
+    return -1;
+  }
+  group->conns = conns;
+  struct evbuffer** outputs = (struct evbuffer**)evws_realloc(group->outputs,
+      capacity * sizeof(struct evbuffer*));
+  if (outputs == NULL) {
+    return -1;
+  }
+  group->outputs = outputs;
+  unsigned char* flags = (unsigned char*)evws_realloc(group->flags,
+      capacity);
+  if (flags == NULL) {
+    return -1;
+  }
+  group->flags = flags;
+  group->capacity = capacity;
+  return 0;
+}
+
+int evwsconngroup_add(struct evwsconngroup* group, struct evwsconn* conn) {
+  if (conn->group != NULL) {
+    return -1;
+  }
+  if (group->size == group->capacity &&
+      group_reserve(group, group->capacity ? group->capacity * 2 : 64) < 0) {
+    return -1;
+  }
+  conn->group = group;
+  conn->group_index = group->size++;
+  group->conns[conn->group_index] = conn;
+  group->outputs[conn->group_index] = send_buffer(conn);
+  update_group(conn);
+  return 0;
+}
+
+void evwsconngroup_remove(struct evwsconngroup* group, struct evwsconn* conn) {
+  if (conn->group != group) {
+    return;
+  }
+  size_t last = --group->size;
+  if (conn->group_index != last) {
+    struct evwsconn* moved = group->conns[last];
+    group->conns[conn->group_index] = moved;
+    group->outputs[conn->group_index] = group->outputs[last];
+    group->flags[conn->group_index] = group->flags[last];
+    moved->group_index = conn->group_index;
+  }
+  conn->group = NULL;
+}
+
+size_t evwsconngroup_size(struct evwsconngroup* group) {
+  return group->size;
+}
+
+// Copy data to each connection, or with buf, add a reference to it
+static void group_send(struct evwsconngroup* group,
+    enum evws_data_type data_type, const unsigned char* data, size_t len,
+    struct evwsbuf* buf) {
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+  size_t header_len = evws_frame_header(header,
+      data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME, 1,
+      len);
+  // wslay never holds back output, since send_callback always takes all of
+  // it, so whole frames can be appended straight to the output buffers.
+  size_t i = 0;
+  while (i < group->size) {
+    if (group->flags[i] & GROUP_SENDABLE) {
+      struct evbuffer* output = group->outputs[i];
+      if (group->flags[i] & GROUP_RECORD_SIZING) {
+        size_records(group->conns[i], header_len + len);
+      }
+      int added;
+      if (buf != NULL) {
+        evwsbuf_incref(buf);
+        added = evbuffer_add(output, header, header_len) == 0 &&
+            evbuffer_add_reference(output, data, len, buf_cleanup, buf) == 0;
+        if (!added) {
+          evwsbuf_decref(buf);
+        }
+      } else {
+        added = evbuffer_add(output, header, header_len) == 0 &&
+            evbuffer_add(output, data, len) == 0;
+      }
+      if (!added ||
+          ((group->flags[i] & GROUP_PACED) &&
+              pace_output(group->conns[i]) < 0)) {
+        // The error callback may free the connection, which moves another
+        // one into this slot
+        struct evwsconn* conn = group->conns[i];
+        ws_error(conn);
+        if (i < group->size && group->conns[i] != conn) {
+          continue;
+        }
+      }
+    }
+    i++;
+  }
+}
+
+void evwsconngroup_broadcast(struct evwsconngroup* group,
+    enum evws_data_type data_type, const unsigned char* data, int len) {
+  group_send(group, data_type, data, len, NULL);
+}
+
+void evwsconngroup_broadcast_buf(struct evwsconngroup* group,
+    enum evws_data_type data_type, struct evwsbuf* buf) {
+  group_send(group, data_type, evwsbuf_data(buf), evwsbuf_len(buf), buf);
+}
@@ -0,0 +1,153 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws/evws.h"
+#include "evws-internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <event2/event.h>
+
+#include "evws_pool.h"
+
+struct evwsbase_pool {
+  struct evws_pool pool;
+  struct evwsbase_pool* next;
+};
+
+/*
+ * The registry lock is only taken to look up a base and to remove one, not
+ * for every reference taken and released by connections.  A base whose
+ * count has dropped to zero is being freed by the thread that released the
+ * last reference, and is skipped by lookups, so its count never rises
+ * again.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct evwsbase* registry = NULL;
+
+// Take a reference unless the count has already dropped to zero
+static int try_incref(struct evwsbase* wsbase) {
+  int refcnt = __atomic_load_n(&wsbase->refcnt, __ATOMIC_RELAXED);
+  while (refcnt > 0) {
+    if (__atomic_compare_exchange_n(&wsbase->refcnt, &refcnt, refcnt + 1, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+struct evwsbase* evwsbase_get(struct event_base* base) {
+  pthread_mutex_lock(&registry_lock);
+  struct evwsbase* wsbase = registry;
+  while (wsbase && (wsbase->base != base || !try_incref(wsbase)))
+    wsbase = wsbase->next;
+  if (wsbase == NULL) {
+    wsbase = (struct evwsbase*)evws_malloc(sizeof(struct evwsbase));
+    if (wsbase) {
+      memset(wsbase, 0, sizeof(struct evwsbase));
+      wsbase->base = base;
+      wsbase->refcnt = 1;
+      if (evwsconn_init_base(wsbase) < 0) {
+        evws_free(wsbase);
+        wsbase = NULL;
+      }
+    }
+    if (wsbase) {
+      wsbase->next = registry;
+      registry = wsbase;
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return wsbase;
+}
+
+void evwsbase_incref(struct evwsbase* wsbase) {
+  __atomic_add_fetch(&wsbase->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void evwsbase_decref(struct evwsbase* wsbase) {
+  if (__atomic_sub_fetch(&wsbase->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  pthread_mutex_lock(&registry_lock);
+  struct evwsbase** curr = &registry;
+  while (*curr != wsbase)
+    curr = &(*curr)->next;
+  *curr = wsbase->next;
+  pthread_mutex_unlock(&registry_lock);
+
+  event_free(wsbase->free_ev);
+  event_free(wsbase->ready_ev);
+  evwsuring_free(wsbase->uring);
+  evws_free(wsbase->batch_msgs);
+  evws_free(wsbase->batch_data);
+  while (wsbase->pools) {
+    struct evwsbase_pool* temp = wsbase->pools;
+    wsbase->pools = temp->next;
+    evws_pool_destroy(&temp->pool);
+    evws_free(temp);
+  }
+  evws_free(wsbase);
+}
+
+struct event_base* evwsbase_get_base(struct evwsbase* wsbase) {
+  return wsbase->base;
+}
+
+struct evws_pool* evwsbase_get_pool(struct evwsbase* wsbase, size_t size,
+    size_t align) {
+  struct evwsbase_pool* curr = wsbase->pools;
+  struct evws_pool probe;
+  evws_pool_init(&probe, size, align);
+  while (curr && (curr->pool.object_size != probe.object_size ||
+      curr->pool.align != probe.align))
+    curr = curr->next;
+  if (curr == NULL) {
+    curr = (struct evwsbase_pool*)evws_malloc(
+        sizeof(struct evwsbase_pool));
+    if (curr == NULL) {
+      return NULL;
+    }
+    curr->pool = probe;
+    curr->next = wsbase->pools;
+    wsbase->pools = curr;
+  }
+  return &curr->pool;
+}
+
+int evwsbase_get_pool_stats(struct evwsbase* wsbase,
+    struct evws_pool_stats* stats, int max) {
+  int count = 0;
+  struct evwsbase_pool* curr;
+  for (curr = wsbase->pools; curr; curr = curr->next, count++) {
+    if (count < max) {
+      stats[count].object_size = curr->pool.object_size;
+      stats[count].in_use = curr->pool.in_use;
+      stats[count].allocated = curr->pool.allocated;
+      stats[count].high_water = curr->pool.high_water;
+    }
+  }
+  return count;
+}
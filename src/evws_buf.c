@@ -0,0 +1,72 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws/evws.h"
+#include "evws-internal.h"
+
+#include <string.h>
+
+/*
+ * The data follows the header in the same allocation.  References may be
+ * dropped on whichever thread runs the connection that last sent the
+ * buffer, so the count is updated atomically.
+ */
+struct evwsbuf {
+  int refcnt;
+  size_t len;
+  unsigned char data[];
+};
+
+struct evwsbuf* evwsbuf_new(const unsigned char* data, size_t len) {
+  struct evwsbuf* buf =
+      (struct evwsbuf*)evws_malloc(sizeof(struct evwsbuf) + len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  buf->refcnt = 1;
+  buf->len = len;
+  if (data != NULL) {
+    memcpy(buf->data, data, len);
+  }
+  return buf;
+}
+
+void evwsbuf_incref(struct evwsbuf* buf) {
+  __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void evwsbuf_decref(struct evwsbuf* buf) {
+  if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+    evws_free(buf);
+  }
+}
+
+unsigned char* evwsbuf_data(struct evwsbuf* buf) {
+  return buf->data;
+}
+
+size_t evwsbuf_len(struct evwsbuf* buf) {
+  return buf->len;
+}
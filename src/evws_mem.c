@@ -0,0 +1,69 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws/evws.h"
+#include "evws-internal.h"
+
+#include <stdlib.h>
+
+static evws_malloc_fn malloc_fn = NULL;
+static evws_realloc_fn realloc_fn = NULL;
+static evws_free_fn free_fn = NULL;
+static void* alloc_ctx = NULL;
+
+void evws_set_allocator(evws_malloc_fn mfn, evws_realloc_fn rfn,
+    evws_free_fn ffn, void* ctx) {
+  if (mfn == NULL || rfn == NULL || ffn == NULL) {
+    mfn = NULL;
+    rfn = NULL;
+    ffn = NULL;
+    ctx = NULL;
+  }
+  malloc_fn = mfn;
+  realloc_fn = rfn;
+  free_fn = ffn;
+  alloc_ctx = ctx;
+}
+
+void* evws_malloc(size_t size) {
+  if (malloc_fn)
+    return malloc_fn(size, alloc_ctx);
+  return malloc(size);
+}
+
+void* evws_realloc(void* ptr, size_t size) {
+  if (realloc_fn)
+    return realloc_fn(ptr, size, alloc_ctx);
+  return realloc(ptr, size);
+}
+
+void evws_free(void* ptr) {
+  if (ptr == NULL)
+    return;
+  if (free_fn)
+    free_fn(ptr, alloc_ctx);
+  else
+    free(ptr);
+}
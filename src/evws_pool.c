@@ -0,0 +1,127 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws_pool.h"
+
+#include "evws-internal.h"
+
+#define POOL_ALIGN 16
+#define POOL_SLAB_BYTES 65536
+#define POOL_MIN_PER_SLAB 16
+
+#define ALIGN_UP(n, align) (((n) + (align) - 1) & ~(size_t)((align) - 1))
+
+struct evws_slab {
+  struct evws_slab* next;
+  size_t count;
+};
+
+void evws_pool_init(struct evws_pool* pool, size_t object_size, size_t align) {
+  if (align < POOL_ALIGN) {
+    align = POOL_ALIGN;
+  }
+  if (object_size < sizeof(void*)) {
+    object_size = sizeof(void*);
+  }
+  pool->align = align;
+  pool->object_size = ALIGN_UP(object_size, align);
+  pool->per_slab = POOL_SLAB_BYTES / pool->object_size;
+  if (pool->per_slab < POOL_MIN_PER_SLAB) {
+    pool->per_slab = POOL_MIN_PER_SLAB;
+  }
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+  pool->in_use = 0;
+  pool->allocated = 0;
+  pool->high_water = 0;
+}
+
+static int add_slab(struct evws_pool* pool, size_t count) {
+  // The allocator only guarantees POOL_ALIGN, so leave room to align the
+  // first object by hand
+  struct evws_slab* slab = (struct evws_slab*)evws_malloc(
+      sizeof(struct evws_slab) + pool->align - 1 + count * pool->object_size);
+  if (slab == NULL) {
+    return -1;
+  }
+  slab->count = count;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  // Thread the new objects onto the free list in address order so that
+  // consecutive allocations are adjacent in memory
+  char* objects = (char*)ALIGN_UP((size_t)(slab + 1), pool->align);
+  size_t i = count;
+  while (i--) {
+    void** obj = (void**)(objects + i * pool->object_size);
+    *obj = pool->free_list;
+    pool->free_list = obj;
+  }
+  pool->allocated += count;
+  return 0;
+}
+
+int evws_pool_prewarm(struct evws_pool* pool, size_t count) {
+  if (pool->allocated - pool->in_use >= count) {
+    return 0;
+  }
+  count -= pool->allocated - pool->in_use;
+  if (count < pool->per_slab) {
+    count = pool->per_slab;
+  }
+  return add_slab(pool, count);
+}
+
+void* evws_pool_alloc(struct evws_pool* pool) {
+  if (pool->free_list == NULL && add_slab(pool, pool->per_slab) < 0) {
+    return NULL;
+  }
+  void** obj = (void**)pool->free_list;
+  pool->free_list = *obj;
+  if (++pool->in_use > pool->high_water) {
+    pool->high_water = pool->in_use;
+  }
+  return obj;
+}
+
+void evws_pool_free(struct evws_pool* pool, void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  *(void**)ptr = pool->free_list;
+  pool->free_list = ptr;
+  pool->in_use--;
+}
+
+void evws_pool_destroy(struct evws_pool* pool) {
+  while (pool->slabs) {
+    struct evws_slab* slab = pool->slabs;
+    pool->slabs = slab->next;
+    evws_free(slab);
+  }
+  pool->free_list = NULL;
+  pool->in_use = 0;
+  pool->allocated = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EVWS_POOL_H_
+#define EVWS_POOL_H_
+
+#include <stddef.h>
+
+struct evws_slab;
+
+/*
+ * A free-list allocator for objects of a single size.  Memory is taken from
+ * the system a slab at a time and is only returned when the pool is
+ * destroyed, so a pool that has seen N objects in use at once can serve N
+ * objects again without touching malloc.  Pools are not thread safe; each
+ * one belongs to a single event_base.
+ */
+struct evws_pool {
+  size_t object_size;
+  size_t align;
+  size_t per_slab;
+  void* free_list;
+  struct evws_slab* slabs;
+  size_t in_use;
+  size_t allocated;
+  size_t high_water;
+};
+
+// Objects are aligned to align bytes, which must be a power of two.  Pass 0
+// for the alignment malloc would give.
+void evws_pool_init(struct evws_pool* pool, size_t object_size, size_t align);
+
+// Make sure at least count objects can be handed out without growing the
+// pool, return 0 on success and -1 if memory could not be allocated
+int evws_pool_prewarm(struct evws_pool* pool, size_t count);
+
+void* evws_pool_alloc(struct evws_pool* pool);
+
+void evws_pool_free(struct evws_pool* pool, void* ptr);
+
+void evws_pool_destroy(struct evws_pool* pool);
+
+#endif /* EVWS_POOL_H_ */
@@ -0,0 +1,344 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws/tlscache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+// Sessions that serialize to more than this (e.g. with large client
+// certificate chains) are not cached
+#define SESSION_DER_MAX 2048
+
+struct ticket_key {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+};
+
+struct session_slot {
+  time_t expires;
+  unsigned int id_len;
+  unsigned int der_len;
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned char der[SESSION_DER_MAX];
+};
+
+/*
+ * The whole cache lives in one shared mapping, so it must not contain any
+ * pointers.  Sessions are kept in a direct-mapped table indexed by a hash of
+ * the session ID, a new session simply replacing whatever was in its slot.
+ */
+struct evwstlscache {
+  pthread_mutex_t lock;
+  size_t map_size;
+  int key_lifetime;
+  time_t key_rotated;
+  int nkeys;
+  struct ticket_key keys[2]; // the current key followed by the previous one
+  struct evwstlscache_stats stats;
+  size_t nslots;
+  struct session_slot slots[];
+};
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static int cache_index = -1;
+
+static void init_cache_index(void) {
+  cache_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static struct evwstlscache* get_cache(SSL_CTX* ctx) {
+  return (struct evwstlscache*)SSL_CTX_get_ex_data(ctx, cache_index);
+}
+
+static void cache_lock(struct evwstlscache* cache) {
+  if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+    // A process died while holding the lock.  A slot it was writing may be
+    // left corrupt, but that will only fail to deserialize.
+    pthread_mutex_consistent(&cache->lock);
+  }
+}
+
+static void cache_unlock(struct evwstlscache* cache) {
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static struct session_slot* find_slot(struct evwstlscache* cache,
+    const unsigned char* id, unsigned int id_len) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+  for (i = 0; i < id_len; i++) {
+    hash = (hash ^ id[i]) * 16777619u;
+  }
+  return &cache->slots[hash % cache->nslots];
+}
+
+static int new_key(struct ticket_key* key) {
+  return RAND_bytes((unsigned char*)key, sizeof(struct ticket_key)) > 0 ?
+      0 : -1;
+}
+
+// Must be called with the lock held
+static void rotate_keys(struct evwstlscache* cache, time_t now) {
+  if (cache->nkeys > 0 && now - cache->key_rotated < cache->key_lifetime) {
+    return;
+  }
+  struct ticket_key key;
+  if (new_key(&key) < 0) {
+    return; // keep using the current key until the next attempt
+  }
+  // The previous key has outlived its second lifetime if nothing rotated it
+  // in time, so drop it rather than keep it as the previous key
+  if (now - cache->key_rotated >= 2 * cache->key_lifetime) {
+    cache->nkeys = 0;
+  }
+  cache->keys[1] = cache->keys[0];
+  cache->keys[0] = key;
+  if (cache->nkeys < 2) {
+    cache->nkeys++;
+  }
+  cache->key_rotated = now;
+  cache->stats.key_rotations++;
+}
+
+static int new_session_cb(SSL* ssl, SSL_SESSION* session) {
+  struct evwstlscache* cache = get_cache(SSL_get_SSL_CTX(ssl));
+  unsigned int id_len;
+  const unsigned char* id = SSL_SESSION_get_id(session, &id_len);
+  int der_len = i2d_SSL_SESSION(session, NULL);
+  if (cache == NULL || id_len == 0 || der_len <= 0 ||
+      der_len > SESSION_DER_MAX) {
+    return 0;
+  }
+  unsigned char der[SESSION_DER_MAX];
+  unsigned char* p = der;
+  i2d_SSL_SESSION(session, &p);
+
+  cache_lock(cache);
+  struct session_slot* slot = find_slot(cache, id, id_len);
+  slot->expires = SSL_SESSION_get_time(session) +
+      SSL_SESSION_get_timeout(session);
+  slot->id_len = id_len;
+  memcpy(slot->id, id, id_len);
+  slot->der_len = der_len;
+  memcpy(slot->der, der, der_len);
+  cache->stats.session_stores++;
+  cache_unlock(cache);
+  return 0; // we didn't keep a reference to session
+}
+
+static SSL_SESSION* get_session_cb(SSL* ssl, const unsigned char* id,
+    int id_len, int* copy) {
+  struct evwstlscache* cache = get_cache(SSL_get_SSL_CTX(ssl));
+  *copy = 0;
+  if (cache == NULL || id_len <= 0 ||
+      id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+    return NULL;
+  }
+  unsigned char der[SESSION_DER_MAX];
+  unsigned int der_len = 0;
+
+  cache_lock(cache);
+  cache->stats.session_lookups++;
+  struct session_slot* slot = find_slot(cache, id, id_len);
+  if (slot->id_len == id_len && !memcmp(slot->id, id, id_len) &&
+      slot->expires > time(NULL)) {
+    der_len = slot->der_len;
+    memcpy(der, slot->der, der_len);
+    cache->stats.session_hits++;
+  }
+  cache_unlock(cache);
+
+  if (der_len == 0) {
+    return NULL;
+  }
+  const unsigned char* p = der;
+  return d2i_SSL_SESSION(NULL, &p, der_len);
+}
+
+static void remove_session_cb(SSL_CTX* ctx, SSL_SESSION* session) {
+  struct evwstlscache* cache = get_cache(ctx);
+  unsigned int id_len;
+  const unsigned char* id = SSL_SESSION_get_id(session, &id_len);
+  if (cache == NULL || id_len == 0) {
+    return;
+  }
+  cache_lock(cache);
+  struct session_slot* slot = find_slot(cache, id, id_len);
+  if (slot->id_len == id_len && !memcmp(slot->id, id, id_len)) {
+    slot->id_len = 0;
+  }
+  cache_unlock(cache);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL* ssl, unsigned char key_name[16],
+    unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int enc) {
+#else
+static int ticket_key_cb(SSL* ssl, unsigned char key_name[16],
+    unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int enc) {
+#endif
+  struct evwstlscache* cache = get_cache(SSL_get_SSL_CTX(ssl));
+  if (cache == NULL) {
+    return -1;
+  }
+  struct ticket_key key;
+  int index = 0;
+
+  cache_lock(cache);
+  rotate_keys(cache, time(NULL));
+  if (enc) {
+    cache->stats.ticket_issued++;
+  } else {
+    cache->stats.ticket_decrypts++;
+    while (index < cache->nkeys &&
+        memcmp(key_name, cache->keys[index].name, 16)) {
+      index++;
+    }
+    if (index == cache->nkeys) {
+      cache_unlock(cache);
+      return 0; // unknown or expired key, do a full handshake
+    }
+    cache->stats.ticket_resumed++;
+    if (index > 0) {
+      cache->stats.ticket_renewed++;
+    }
+  }
+  key = cache->keys[index];
+  cache_unlock(cache);
+
+  if (enc) {
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0) {
+      return -1;
+    }
+    memcpy(key_name, key.name, 16);
+    if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key,
+        iv)) {
+      return -1;
+    }
+  } else if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL,
+      key.aes_key, iv)) {
+    return -1;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+      key.hmac_key, sizeof(key.hmac_key));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+      "SHA256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+  if (!EVP_MAC_CTX_set_params(mac, params)) {
+    return -1;
+  }
+#else
+  if (!HMAC_Init_ex(mac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(),
+      NULL)) {
+    return -1;
+  }
+#endif
+  // Returning 2 asks OpenSSL to issue a new ticket under the current key
+  return index > 0 ? 2 : 1;
+}
+
+struct evwstlscache *evwstlscache_new(size_t slots, int key_lifetime) {
+  if (slots == 0 || key_lifetime <= 0) {
+    return NULL;
+  }
+  size_t map_size = sizeof(struct evwstlscache) +
+      slots * sizeof(struct session_slot);
+  struct evwstlscache* cache = (struct evwstlscache*)mmap(NULL, map_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (cache == MAP_FAILED) {
+    return NULL;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int ret = pthread_mutex_init(&cache->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (ret != 0) {
+    munmap(cache, map_size);
+    return NULL;
+  }
+  cache->map_size = map_size;
+  cache->key_lifetime = key_lifetime;
+  cache->nslots = slots;
+  rotate_keys(cache, time(NULL));
+  if (cache->nkeys == 0) {
+    evwstlscache_free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+int evwstlscache_attach(struct evwstlscache *cache, SSL_CTX *ctx) {
+  pthread_once(&index_once, init_cache_index);
+  if (cache_index < 0 || !SSL_CTX_set_ex_data(ctx, cache_index, cache)) {
+    return -1;
+  }
+  // Sessions are only looked up in the shared cache, so that a session
+  // stored by any worker can be resumed by all of them
+  SSL_CTX_set_session_cache_mode(ctx,
+      SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"libevws", 7);
+  SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+  SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+  SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+  return 0;
+}
+
+void evwstlscache_get_stats(struct evwstlscache *cache,
+    struct evwstlscache_stats *stats) {
+  cache_lock(cache);
+  *stats = cache->stats;
+  cache_unlock(cache);
+}
+
+void evwstlscache_free(struct evwstlscache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  munmap(cache, cache->map_size);
+}
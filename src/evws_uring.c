@@ -0,0 +1,314 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "evws-internal.h"
+
+#ifdef EVWS_HAVE_URING
+
+#include <errno.h>
+#include <string.h>
+#include <event2/event.h>
+#include <liburing.h>
+
+/*
+ * One io_uring per base.  Operations only queue their SQEs, which are all
+ * submitted together by submit_ev, activated by the first one queued in a
+ * round of callbacks, so a loop iteration that sends to many connections
+ * makes a single io_uring_enter().  Completions are reaped when libevent
+ * reports the ring's descriptor readable, which it is while the completion
+ * queue is not empty.
+ *
+ * Receives are given buffers from a ring of provided buffers shared by all
+ * the base's connections.  A buffer is only held while its completion is
+ * being handled, and given back as soon as its data has been read or
+ * copied, so a small number of buffers serves any number of connections.
+ */
+#define URING_ENTRIES 256
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+struct evwsuring {
+  struct evwsbase* wsbase;
+  struct io_uring ring;
+  struct event* cqe_ev;
+  struct event* submit_ev;
+  int submit_queued;
+  // requests submitted or queued whose last completion is not yet reaped
+  unsigned int inflight;
+  // operations to prepare just before the next submission
+  struct evwsuring_op* deferred;
+  struct io_uring_buf_ring* buf_ring;
+  unsigned char* bufs;
+  struct evwsuring_orphan* orphans;
+};
+
+static void queue_submit(struct evwsuring* ring) {
+  if (!ring->submit_queued) {
+    ring->submit_queued = 1;
+    event_active(ring->submit_ev, EV_TIMEOUT, 0);
+  }
+}
+
+// The callbacks run from here may release the last reference on the base,
+// and so free the ring, so they hold one more
+static void submit_cb(evutil_socket_t fd, short events, void* ring_ptr) {
+  struct evwsuring* ring = (struct evwsuring*)ring_ptr;
+  struct evwsbase* wsbase = ring->wsbase;
+  evwsbase_incref(wsbase);
+  while (ring->deferred) {
+    struct evwsuring_op* op = ring->deferred;
+    ring->deferred = op->next_deferred;
+    op->next_deferred = NULL;
+    op->deferred = 0;
+    op->prepare(op);
+  }
+  io_uring_submit(&ring->ring);
+  ring->submit_queued = 0;
+  evwsbase_decref(wsbase);
+}
+
+static void cqe_cb(evutil_socket_t fd, short events, void* ring_ptr) {
+  struct evwsuring* ring = (struct evwsuring*)ring_ptr;
+  struct evwsbase* wsbase = ring->wsbase;
+  struct io_uring_cqe* cqe;
+  evwsbase_incref(wsbase);
+  while (io_uring_peek_cqe(&ring->ring, &cqe) == 0) {
+    struct evwsuring_op* op =
+        (struct evwsuring_op*)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    unsigned int flags = cqe->flags;
+    // seen first, as the operation may be freed by its callback
+    io_uring_cqe_seen(&ring->ring, cqe);
+    if (!(flags & IORING_CQE_F_MORE)) {
+      ring->inflight--;
+    }
+    if (op != NULL) {
+      op->complete(op, res, flags);
+    }
+  }
+  evwsbase_decref(wsbase);
+}
+
+static int setup_buffers(struct evwsuring* ring) {
+  int ret, i;
+  ring->bufs = (unsigned char*)evws_malloc(
+      (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+  if (ring->bufs == NULL) {
+    return -1;
+  }
+  ring->buf_ring = io_uring_setup_buf_ring(&ring->ring, URING_BUFFERS,
+      URING_BUFFER_GROUP, 0, &ret);
+  if (ring->buf_ring == NULL) {
+    evws_free(ring->bufs);
+    return -1;
+  }
+  for (i = 0; i < URING_BUFFERS; i++) {
+    io_uring_buf_ring_add(ring->buf_ring, ring->bufs + i * URING_BUFFER_SIZE,
+        URING_BUFFER_SIZE, i, io_uring_buf_ring_mask(URING_BUFFERS), i);
+  }
+  io_uring_buf_ring_advance(ring->buf_ring, URING_BUFFERS);
+  return 0;
+}
+
+struct evwsuring* evwsuring_get(struct evwsbase* wsbase) {
+  if (wsbase->uring != NULL) {
+    return wsbase->uring;
+  }
+  struct evwsuring* ring =
+      (struct evwsuring*)evws_malloc(sizeof(struct evwsuring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(struct evwsuring));
+  ring->wsbase = wsbase;
+  if (io_uring_queue_init(URING_ENTRIES, &ring->ring, 0) < 0) {
+    evws_free(ring);
+    return NULL;
+  }
+  if (setup_buffers(ring) < 0) {
+    io_uring_queue_exit(&ring->ring);
+    evws_free(ring);
+    return NULL;
+  }
+  ring->cqe_ev = event_new(wsbase->base, ring->ring.ring_fd,
+      EV_READ|EV_PERSIST, cqe_cb, ring);
+  ring->submit_ev = event_new(wsbase->base, -1, 0, submit_cb, ring);
+  if (ring->cqe_ev == NULL || ring->submit_ev == NULL ||
+      event_add(ring->cqe_ev, NULL) < 0) {
+    evwsuring_free(ring);
+    return NULL;
+  }
+  wsbase->uring = ring;
+  return ring;
+}
+
+/*
+ * Closing the ring only starts cancelling what is in flight, and the kernel
+ * may still be filling receive buffers or reading the data of sends after
+ * io_uring_queue_exit() returns.  So everything is cancelled and waited for
+ * here, and only then are the buffers, and what the orphans hold, released.
+ * The completions are only counted: their operations' owners are all gone.
+ */
+static void cancel_inflight(struct evwsuring* ring) {
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  if (ring->inflight == 0) {
+    return;
+  }
+  io_uring_submit(&ring->ring);
+  sqe = io_uring_get_sqe(&ring->ring);
+  if (sqe != NULL) {
+    io_uring_prep_cancel(sqe, NULL, IORING_ASYNC_CANCEL_ANY);
+    io_uring_sqe_set_data(sqe, NULL);
+    ring->inflight++;
+    io_uring_submit(&ring->ring);
+  }
+  while (ring->inflight > 0 && io_uring_wait_cqe(&ring->ring, &cqe) == 0) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      ring->inflight--;
+    }
+    io_uring_cqe_seen(&ring->ring, cqe);
+  }
+}
+
+void evwsuring_free(struct evwsuring* ring) {
+  if (ring == NULL) {
+    return;
+  }
+  if (ring->cqe_ev != NULL) {
+    event_free(ring->cqe_ev);
+  }
+  if (ring->submit_ev != NULL) {
+    event_free(ring->submit_ev);
+  }
+  cancel_inflight(ring);
+  io_uring_free_buf_ring(&ring->ring, ring->buf_ring, URING_BUFFERS,
+      URING_BUFFER_GROUP);
+  io_uring_queue_exit(&ring->ring);
+  while (ring->orphans) {
+    struct evwsuring_orphan* orphan = ring->orphans;
+    ring->orphans = orphan->next;
+    orphan->release(orphan);
+  }
+  evws_free(ring->bufs);
+  evws_free(ring);
+}
+
+void evwsuring_adopt(struct evwsuring* ring, struct evwsuring_orphan* orphan) {
+  orphan->next = ring->orphans;
+  ring->orphans = orphan;
+}
+
+void evwsuring_disown(struct evwsuring* ring,
+    struct evwsuring_orphan* orphan) {
+  struct evwsuring_orphan** curr = &ring->orphans;
+  while (*curr != orphan) {
+    curr = &(*curr)->next;
+  }
+  *curr = orphan->next;
+}
+
+int evwsuring_reserve(struct evwsuring* ring, unsigned int count) {
+  if (io_uring_sq_space_left(&ring->ring) < count) {
+    io_uring_submit(&ring->ring);
+  }
+  return io_uring_sq_space_left(&ring->ring) < count ? -1 : 0;
+}
+
+struct io_uring_sqe* evwsuring_get_sqe(struct evwsuring* ring,
+    struct evwsuring_op* op) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->ring);
+  if (sqe == NULL) {
+    io_uring_submit(&ring->ring);
+    sqe = io_uring_get_sqe(&ring->ring);
+    if (sqe == NULL) {
+      return NULL;
+    }
+  }
+  io_uring_sqe_set_data(sqe, op);
+  ring->inflight++;
+  queue_submit(ring);
+  return sqe;
+}
+
+void evwsuring_submit(struct evwsuring* ring) {
+  io_uring_submit(&ring->ring);
+}
+
+void evwsuring_defer(struct evwsuring* ring, struct evwsuring_op* op) {
+  if (op->deferred) {
+    return;
+  }
+  op->deferred = 1;
+  op->next_deferred = ring->deferred;
+  ring->deferred = op;
+  queue_submit(ring);
+}
+
+int evwsuring_cancel(struct evwsuring* ring, struct evwsuring_op* op) {
+  // the cancel's own completion carries no operation and is ignored
+  struct io_uring_sqe* sqe = evwsuring_get_sqe(ring, NULL);
+  if (sqe == NULL) {
+    return -1;
+  }
+  io_uring_prep_cancel(sqe, op, IORING_ASYNC_CANCEL_ALL);
+  return 0;
+}
+
+void evwsuring_prep_recv(struct evwsuring* ring, struct io_uring_sqe* sqe,
+    int fd) {
+  io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+const unsigned char* evwsuring_buffer(struct evwsuring* ring,
+    unsigned int flags) {
+  unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  return ring->bufs + (size_t)bid * URING_BUFFER_SIZE;
+}
+
+void evwsuring_recycle(struct evwsuring* ring, unsigned int flags) {
+  if (!(flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+  unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  io_uring_buf_ring_add(ring->buf_ring,
+      ring->bufs + (size_t)bid * URING_BUFFER_SIZE, URING_BUFFER_SIZE, bid,
+      io_uring_buf_ring_mask(URING_BUFFERS), 0);
+  io_uring_buf_ring_advance(ring->buf_ring, 1);
+}
+
+#else
+
+struct evwsuring* evwsuring_get(struct evwsbase* wsbase) {
+  return NULL;
+}
+
+void evwsuring_free(struct evwsuring* ring) {
+}
+
+#endif
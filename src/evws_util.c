@@ -251,3 +251,46 @@ int evaluate_websocket_handshake(const char* data, size_t len,
 
   return 0;
 }
+
+size_t evws_frame_header(unsigned char buf[EVWS_FRAME_HEADER_MAX],
+    uint8_t opcode, int fin, uint64_t payload_len) {
+  buf[0] = (fin ? 0x80 : 0) | (opcode & 0x0f);
+  if (payload_len < 126) {
+    buf[1] = (unsigned char)payload_len;
+    return 2;
+  }
+  if (payload_len <= 0xffff) {
+    buf[1] = 126;
+    buf[2] = (unsigned char)(payload_len >> 8);
+    buf[3] = (unsigned char)payload_len;
+    return 4;
+  }
+  buf[1] = 127;
+  int i;
+  for (i = 0; i < 8; i++) {
+    buf[2 + i] = (unsigned char)(payload_len >> (56 - 8 * i));
+  }
+  return 10;
+}
+
+uint64_t evws_frame_length(const unsigned char* buf, size_t len) {
+  if (len < 2) {
+    return 0;
+  }
+  uint64_t payload_len = buf[1] & 0x7f;
+  if (payload_len < 126) {
+    return 2 + payload_len;
+  }
+  if (payload_len == 126) {
+    return len < 4 ? 0 : 4 + ((uint64_t)buf[2] << 8 | buf[3]);
+  }
+  if (len < 10) {
+    return 0;
+  }
+  payload_len = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    payload_len = payload_len << 8 | buf[2 + i];
+  }
+  return 10 + payload_len;
+}
@@ -26,11 +26,23 @@
 #ifndef EVWS_UTIL_H_
 #define EVWS_UTIL_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 
+// The largest header of an unmasked (server to client) frame
+#define EVWS_FRAME_HEADER_MAX 10
+
 // return 0 on success and sets accept_key and subprotocol, return -1 on error
 int evaluate_websocket_handshake(const char* data, size_t len,
     const char* supported_subprotocols[], char accept_key[29],
     const char** subprotocol);
 
+// writes the header of an unmasked frame to buf and returns its length
+size_t evws_frame_header(unsigned char buf[EVWS_FRAME_HEADER_MAX],
+    uint8_t opcode, int fin, uint64_t payload_len);
+
+// returns the length of the unmasked frame whose first len bytes are in buf,
+// header included, or 0 if buf does not hold all of the header
+uint64_t evws_frame_length(const unsigned char* buf, size_t len);
+
 #endif /* EVWS_UTIL_H_ */
@@ -34,8 +34,133 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct bufferevent;
 struct evwsconn;
+struct evwsconngroup;
+struct evwsbuf;
+
+/** Replacement for malloc(), ctx is the pointer given to evws_set_allocator */
+typedef void *(*evws_malloc_fn)(size_t size, void *ctx);
+
+/** Replacement for realloc(), ctx is the pointer given to evws_set_allocator */
+typedef void *(*evws_realloc_fn)(void *ptr, size_t size, void *ctx);
+
+/** Replacement for free(), ctx is the pointer given to evws_set_allocator */
+typedef void (*evws_free_fn)(void *ptr, void *ctx);
+
+/**
+   Route all memory allocated by libevws through the given functions.
+
+   This must be called before any other libevws function, as memory
+   allocated with one allocator will be released with whichever allocator is
+   in place at the time.  Passing NULL for any of the functions restores the
+   C library allocator.
+
+   Memory allocated by the libraries libevws is built on is not covered.
+   Use event_set_mem_functions() for libevent's bufferevents and evbuffers
+   and CRYPTO_set_mem_functions() for OpenSSL.  wslay always uses the C
+   library allocator.
+
+   @param malloc_fn Replacement for malloc()
+   @param realloc_fn Replacement for realloc()
+   @param free_fn Replacement for free()
+   @param ctx A user-supplied pointer passed to each of the functions
+ */
+void evws_set_allocator(evws_malloc_fn malloc_fn, evws_realloc_fn realloc_fn,
+    evws_free_fn free_fn, void *ctx);
+
+/** Usage of one of the memory pools on an event base */
+struct evws_pool_stats {
+  /** Size in bytes of each object handed out by the pool */
+  size_t object_size;
+  /** Number of objects currently in use */
+  size_t in_use;
+  /** Number of objects the pool holds memory for, used or free */
+  size_t allocated;
+  /** The largest number of objects that have been in use at once */
+  size_t high_water;
+};
+
+/** Statistics for a single connection, see evwsconn_get_stats() */
+struct evwsconn_stats {
+  /**
+     The maximum TLS record size currently used for sending, or 0 if the
+     connection does not use TLS record sizing
+   */
+  unsigned int tls_record_size;
+  /** Bytes sent while small TLS records were in use */
+  uint64_t small_record_bytes;
+  /** Bytes sent while full size TLS records were in use */
+  uint64_t full_record_bytes;
+  /** Nonzero while the connection's buffers are released for being idle */
+  int compacted;
+  /** Number of times the connection's buffers have been released */
+  uint64_t idle_compactions;
+  /**
+     Bytes queued on the connection and not yet passed to the socket, see
+     evwsconnlistener_set_notsent_lowat()
+   */
+  size_t queued_bytes;
+  /**
+     Bytes sent with MSG_ZEROCOPY, see evwsconnlistener_set_zerocopy()
+   */
+  uint64_t zerocopy_bytes;
+  /**
+     Number of zero-copy completions for which the kernel copied the data
+     after all, e.g. because the route's device can't send from user memory
+   */
+  uint64_t zerocopy_copied;
+  /**
+     Number of times reading stopped for the iteration's read budget, see
+     evwsconnlistener_set_read_budget()
+   */
+  uint64_t read_throttles;
+};
+
+/** Socket options that can be set on a connection's socket */
+enum evws_sockopt {
+  /** TCP_NODELAY, nonzero to send small writes without delay */
+  EVWS_SOCKOPT_NODELAY = 0,
+  /** SO_SNDBUF, the kernel send buffer size in bytes */
+  EVWS_SOCKOPT_SNDBUF,
+  /** SO_RCVBUF, the kernel receive buffer size in bytes */
+  EVWS_SOCKOPT_RCVBUF,
+  /**
+     TCP_USER_TIMEOUT, how many milliseconds sent data may stay
+     unacknowledged before the connection is dropped
+   */
+  EVWS_SOCKOPT_USER_TIMEOUT,
+  /** SO_KEEPALIVE, nonzero to send TCP keepalive probes */
+  EVWS_SOCKOPT_KEEPALIVE,
+  /** TCP_KEEPIDLE, seconds of idleness before the first keepalive probe */
+  EVWS_SOCKOPT_KEEPIDLE,
+  /** TCP_KEEPINTVL, seconds between keepalive probes */
+  EVWS_SOCKOPT_KEEPINTVL,
+  /** TCP_KEEPCNT, unanswered probes before the connection is dropped */
+  EVWS_SOCKOPT_KEEPCNT,
+  /** IP_TOS, or IPV6_TCLASS on IPv6 sockets */
+  EVWS_SOCKOPT_TOS,
+  EVWS_SOCKOPT_MAX
+};
+
+/** A set of socket options, see evwsconnlistener_set_sockopts() */
+struct evws_sockopts {
+  /**
+     The value of each option, indexed by enum evws_sockopt, or -1 to leave
+     the option unchanged
+   */
+  int values[EVWS_SOCKOPT_MAX];
+};
+
+/**
+   Initialize a set of socket options to leave every option unchanged.
+
+   @param opts The options to initialize
+ */
+void evws_sockopts_init(struct evws_sockopts *opts);
 
 /** Types of data in messages sent and received by a WebSocket connection */
 enum evws_data_type {
@@ -43,6 +168,19 @@ enum evws_data_type {
   EVWS_DATA_BINARY = 1,
 };
 
+/**
+   A message, as sent by evwsconn_send_messages() or received by an
+   evwsconn_batch_cb
+ */
+struct evws_msg {
+  /** The type of data in the message */
+  enum evws_data_type data_type;
+  /** The message's data */
+  const unsigned char *data;
+  /** The length of the data */
+  size_t len;
+};
+
 /**
    A callback invoked when a new message been received on the WebSocket
    connection
@@ -56,6 +194,19 @@ enum evws_data_type {
 typedef void (*evwsconn_message_cb)(struct evwsconn *conn,
     enum evws_data_type, const unsigned char* data, int len, void *user_data);
 
+/**
+   A callback invoked with all of the messages received on the WebSocket
+   connection in one read, see evwsconn_set_batch_cb().
+
+   @param conn The evwsconn that received the messages
+   @param msgs The messages received, in order, which are only valid until
+      the callback returns
+   @param n The number of messages, at least 1
+   @param user_data The user-supplied pointer passed to evwsconn_set_cbs
+ */
+typedef void (*evwsconn_batch_cb)(struct evwsconn *conn,
+    const struct evws_msg *msgs, size_t n, void *user_data);
+
 /**
    A callback invoked when the WebSocket connection has been closed.
 
@@ -86,6 +237,74 @@ void evwsconn_set_cbs(struct evwsconn *conn, evwsconn_message_cb message_cb,
     evwsconn_close_cb close_cb, evwsconn_error_cb error_cb,
     void* user_data);
 
+/**
+   Sets (or clears) the batch callback on a WebSocket connection.
+
+   While a batch callback is set, it is called once for all of the messages
+   received in each read from the socket, instead of the message callback
+   being called for each one.  A client that sends many small messages can
+   then be handled in bulk, e.g. with one database transaction per batch.
+   The messages are copied to collect them, so this is best avoided for
+   large messages.
+
+   @param conn The evwsconn
+   @param batch_cb Batch callback, or NULL to receive messages one by one
+ */
+void evwsconn_set_batch_cb(struct evwsconn *conn, evwsconn_batch_cb batch_cb);
+
+/**
+   A callback invoked with each part of a message's data as it is received,
+   see evwsconn_set_stream_cb().
+
+   @param conn The evwsconn that received the data
+   @param data_type The type of the message
+   @param data The next part of the message's data
+   @param len The length of this part
+   @param fin Nonzero if the message is complete, in which case len is 0
+   @param user_data The user-supplied pointer passed to evwsconn_set_cbs
+ */
+typedef void (*evwsconn_stream_cb)(struct evwsconn *conn,
+    enum evws_data_type data_type, const unsigned char* data, size_t len,
+    int fin, void *user_data);
+
+/**
+   Sets (or clears) the stream callback on a WebSocket connection.
+
+   While a stream callback is set, messages are not collected in memory:
+   each part of a message is passed to the stream callback as it arrives,
+   and the message callback is not called.  This suits large messages that
+   can be written out or processed as they come in.  This should be set
+   before the first message arrives, e.g. when the connection is accepted.
+
+   @param conn The evwsconn
+   @param stream_cb Stream callback, or NULL to receive whole messages
+ */
+void evwsconn_set_stream_cb(struct evwsconn *conn,
+    evwsconn_stream_cb stream_cb);
+
+/**
+   A callback invoked when a WebSocket connection has sent everything it
+   was given, or, with evwsconnlistener_set_notsent_lowat(), when its queue
+   has drained and the socket is below the low mark.
+
+   @param conn The evwsconn that can take more data
+   @param user_data The user-supplied pointer passed to evwsconn_set_cbs
+ */
+typedef void (*evwsconn_writable_cb)(struct evwsconn *conn, void *user_data);
+
+/**
+   Sets (or clears) the writable callback on a WebSocket connection.
+
+   Sending only from this callback keeps each message as fresh as the
+   connection allows, since nothing is queued behind data the client is
+   still waiting for.
+
+   @param conn The evwsconn
+   @param writable_cb Writable callback, or NULL
+ */
+void evwsconn_set_writable_cb(struct evwsconn *conn,
+    evwsconn_writable_cb writable_cb);
+
 /**
    Send a new message on the WebSocket connection.
 
@@ -97,9 +316,156 @@ void evwsconn_set_cbs(struct evwsconn *conn, evwsconn_message_cb message_cb,
 void evwsconn_send_message(struct evwsconn *conn,
     enum evws_data_type data_type, const unsigned char* data, int len);
 
+/**
+   A callback invoked once libevws no longer needs the data given to
+   evwsconn_send_message_ref().
+
+   @param data The data that was sent
+   @param len The length of the data
+   @param arg The user-supplied pointer passed with the data
+ */
+typedef void (*evws_cleanup_cb)(const void *data, size_t len, void *arg);
+
+/**
+   Send a new message on the WebSocket connection without copying its data.
+
+   The data must stay valid and unchanged until cleanup is called, which
+   may happen before this function returns.  With
+   evwsconnlistener_set_zerocopy(), large messages on plain connections are
+   sent from the data itself and cleanup waits until the kernel has
+   finished with it, which is usually once the client has acknowledged it,
+   and may be after the connection has been freed.
+
+   @param conn The evwsconn on which to send the message
+   @param data_type The type of data to be sent
+   @param data The data to send
+   @param len The length of the data
+   @param cleanup Called once the data is no longer needed, or NULL
+   @param arg A user-supplied pointer passed to cleanup
+   @return 0 on success, -1 if the connection is closed or closing, or the
+      message could not be sent
+ */
+int evwsconn_send_message_ref(struct evwsconn *conn,
+    enum evws_data_type data_type, const unsigned char* data, size_t len,
+    evws_cleanup_cb cleanup, void *arg);
+
+/**
+   Allocate a reference counted buffer for a message's data.
+
+   A message received in a message callback can be kept by copying it into
+   a buffer, which can then be sent to any number of connections with
+   evwsconn_send_buf() or evwsconngroup_broadcast_buf() without being copied
+   again.  The buffer is freed once the caller and every send have released
+   it.  References may be taken and released from any thread.
+
+   @param data The data to copy into the buffer, or NULL to leave it
+      uninitialized, to be filled in through evwsbuf_data()
+   @param len The length of the data
+   @return The new buffer holding one reference, or NULL on allocation
+      failure
+ */
+struct evwsbuf* evwsbuf_new(const unsigned char *data, size_t len);
+
+/** Take a reference on a buffer. */
+void evwsbuf_incref(struct evwsbuf *buf);
+
+/** Release a reference on a buffer, freeing it if it was the last one. */
+void evwsbuf_decref(struct evwsbuf *buf);
+
+/**
+   Get the data in a buffer.  It must not be changed once the buffer has
+   been sent.
+ */
+unsigned char* evwsbuf_data(struct evwsbuf *buf);
+
+/** Get the length of the data in a buffer. */
+size_t evwsbuf_len(struct evwsbuf *buf);
+
+/**
+   Send a buffer's data as a message on the WebSocket connection.
+
+   The connection takes its own reference on the buffer until the data has
+   been sent, so the caller may release theirs straight away.
+
+   @param conn The evwsconn on which to send the message
+   @param data_type The type of data to be sent
+   @param buf The buffer holding the data
+   @return 0 on success, -1 if the connection is closed or closing, or the
+      message could not be sent
+ */
+int evwsconn_send_buf(struct evwsconn *conn, enum evws_data_type data_type,
+    struct evwsbuf *buf);
+
+/**
+   Send several messages on the WebSocket connection at once.
+
+   This is equivalent to calling evwsconn_send_message() for each message
+   in turn, but all of the frames are added to the connection's output
+   together, which is much cheaper when there are many small messages.
+
+   @param conn The evwsconn on which to send the messages
+   @param msgs The messages to send, in order
+   @param n The number of messages
+   @return 0 on success, -1 if the connection is closed or closing, or the
+      messages could not be sent
+ */
+int evwsconn_send_messages(struct evwsconn *conn,
+    const struct evws_msg *msgs, size_t n);
+
+/**
+   Reserve space to build a message in directly.
+
+   The space is in the connection's own send buffer, so a message built
+   there does not need to be copied before it is sent.  The message is sent
+   by evwsconn_commit(), which must be called before anything else is sent
+   on the connection and before returning to the event loop.  Reserving
+   again without committing abandons the earlier reservation.
+
+   @param conn The evwsconn on which the message will be sent
+   @param max_len The largest length the message may have
+   @return Space for max_len bytes, or NULL if the connection is closed or
+      closing, or on allocation failure
+ */
+unsigned char* evwsconn_reserve(struct evwsconn *conn, size_t max_len);
+
+/**
+   Send the message built in the space returned by evwsconn_reserve().
+
+   @param conn The evwsconn on which space was reserved
+   @param data_type The type of data in the message
+   @param used The length of the message, at most the length reserved
+   @return 0 on success, -1 if there is no reservation, used is too large,
+      the connection has started closing, or the message could not be sent
+ */
+int evwsconn_commit(struct evwsconn *conn, enum evws_data_type data_type,
+    size_t used);
+
+/**
+   Send part of a file as a binary message on the WebSocket connection.
+
+   On plain connections, and with kernel TLS, the file is sent with
+   sendfile() and never read into user space.  Over OpenSSL it is mapped
+   into memory rather than copied.  The file must not be truncated until it
+   has been sent.
+
+   @param conn The evwsconn on which to send the message
+   @param fd The file to send, which is closed once it has been sent, or if
+      sending fails
+   @param offset The offset in the file at which the message starts
+   @param len The length of the message
+   @return 0 on success, -1 if the connection is closed or closing, or the
+      file could not be sent
+ */
+int evwsconn_send_file(struct evwsconn *conn, int fd, int64_t offset,
+    int64_t len);
+
 /**
    Get the bufferevent for this connection.
 
+   NOTE: If kTLS offload is enabled on the listener (see
+   evwsconnlistener_set_ktls()), the bufferevent is replaced once shortly
+   after the connection is created, so it should not be kept.
+
    @param conn The evwsconn for which to get the bufferevent
   */
 struct bufferevent* evwsconn_get_bufferevent(struct evwsconn *conn);
@@ -111,6 +477,37 @@ struct bufferevent* evwsconn_get_bufferevent(struct evwsconn *conn);
   */
 const char* evwsconn_get_subprotocol(struct evwsconn *conn);
 
+/**
+   Set an option on the connection's socket.
+
+   @param conn The evwsconn
+   @param opt The option to set
+   @param value The option's new value
+   @return 0 on success, -1 on failure or if the option is not supported
+  */
+int evwsconn_set_sockopt(struct evwsconn *conn, enum evws_sockopt opt,
+    int value);
+
+/**
+   Get statistics for this connection.
+
+   @param conn The evwsconn for which to get statistics
+   @param stats Filled in with the connection's statistics
+  */
+void evwsconn_get_stats(struct evwsconn *conn, struct evwsconn_stats *stats);
+
+/**
+   Get the user area allocated together with this connection.
+
+   The area is zero-filled when the connection is created, it is aligned for
+   any type and it is released by evwsconn_free().
+
+   @param conn The evwsconn for which to get the user area
+   @return The user area, or NULL if the listener that created the connection
+      had no user area size set (see evwsconnlistener_set_userdata_size())
+  */
+void* evwsconn_get_userdata_area(struct evwsconn *conn);
+
 /**
    Send a close message to client and, once sent, close the connection.
 
@@ -124,6 +521,60 @@ void evwsconn_send_close(struct evwsconn *conn);
 /** Disable and deallocate an evwsconn */
 void evwsconn_free(struct evwsconn* conn);
 
+/**
+   Allocate a new, empty connection group.  A group holds connections in a
+   compact table so that a message can be broadcast to all of them without
+   visiting each connection's own state.
+
+   @return The new group, or NULL on allocation failure
+ */
+struct evwsconngroup* evwsconngroup_new(void);
+
+/**
+   Deallocate a connection group.  The connections in it are not affected.
+ */
+void evwsconngroup_free(struct evwsconngroup* group);
+
+/**
+   Add a connection to a group.  A connection can belong to only one group at
+   a time, and is removed from it automatically by evwsconn_free().
+
+   @param group The group to add the connection to
+   @param conn The evwsconn to add
+   @return 0 on success, -1 if the connection is already in a group or on
+      allocation failure
+ */
+int evwsconngroup_add(struct evwsconngroup* group, struct evwsconn* conn);
+
+/** Remove a connection from a group. */
+void evwsconngroup_remove(struct evwsconngroup* group, struct evwsconn* conn);
+
+/** Get the number of connections in a group. */
+size_t evwsconngroup_size(struct evwsconngroup* group);
+
+/**
+   Send a message to every open connection in a group.  The frame header is
+   built once for all of the connections.
+
+   @param group The group to send the message to
+   @param data_type The type of data to be sent
+   @param data The data to send
+   @param len The length of the data
+ */
+void evwsconngroup_broadcast(struct evwsconngroup* group,
+    enum evws_data_type data_type, const unsigned char* data, int len);
+
+/**
+   Send a buffer's data to every open connection in a group.  Each
+   connection references the buffer rather than copying the data.
+
+   @param group The group to send the message to
+   @param data_type The type of data to be sent
+   @param buf The buffer holding the data
+ */
+void evwsconngroup_broadcast_buf(struct evwsconngroup* group,
+    enum evws_data_type data_type, struct evwsbuf* buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,117 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EVWS_TLSCACHE_H_
+#define EVWS_TLSCACHE_H_
+
+/**
+   @file evws/tlscache.h
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+struct evwstlscache;
+
+/**
+   Counters kept by an evwstlscache, shared by every thread and process using
+   it.  The resumption hit rate is
+   (session_hits + ticket_resumed) / (session_lookups + ticket_decrypts).
+ */
+struct evwstlscache_stats {
+  /** Sessions stored in the server-side cache */
+  uint64_t session_stores;
+  /** Session ID lookups in the server-side cache */
+  uint64_t session_lookups;
+  /** Lookups that found a usable session */
+  uint64_t session_hits;
+  /** Session tickets issued */
+  uint64_t ticket_issued;
+  /** Session tickets presented by clients */
+  uint64_t ticket_decrypts;
+  /** Presented tickets whose key was still valid */
+  uint64_t ticket_resumed;
+  /** Resumed tickets that were issued under the previous key and renewed */
+  uint64_t ticket_renewed;
+  /** Ticket key rotations */
+  uint64_t key_rotations;
+};
+
+/**
+   Allocate a TLS session cache in shared memory.
+
+   The cache holds a server-side session cache and the session ticket keys.
+   It may be attached to the SSL_CTX of listeners in any number of threads.
+   To share it between processes, create it before forking so the children
+   inherit the mapping.
+
+   Ticket keys are generated at random and rotated every key_lifetime
+   seconds.  Tickets issued under the previous key are still accepted, and
+   are renewed, so a ticket is valid for between one and two key lifetimes.
+
+   @param slots The number of sessions the server-side cache can hold
+   @param key_lifetime The number of seconds between ticket key rotations
+   @return The new cache, or NULL on failure
+ */
+struct evwstlscache *evwstlscache_new(size_t slots, int key_lifetime);
+
+/**
+   Use a TLS session cache for resumption on connections made with an
+   SSL_CTX.  This replaces the SSL_CTX's session cache callbacks and its
+   ticket key callback.  It also sets the SSL_CTX's session ID context,
+   which is required for sessions to be resumed from the server-side cache.
+
+   @param cache The evwstlscache
+   @param ctx The server SSL context passed to evwsconnlistener_new
+   @return 0 on success, -1 on failure
+ */
+int evwstlscache_attach(struct evwstlscache *cache, SSL_CTX *ctx);
+
+/**
+   Get the counters of a TLS session cache.
+
+   @param cache The evwstlscache
+   @param stats Filled in with the current counters
+ */
+void evwstlscache_get_stats(struct evwstlscache *cache,
+    struct evwstlscache_stats *stats);
+
+/**
+   Unmap a TLS session cache from this process.  Any SSL_CTX it is attached
+   to must no longer be in use.
+ */
+void evwstlscache_free(struct evwstlscache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVWS_TLSCACHE_H_ */
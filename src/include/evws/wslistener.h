@@ -34,6 +34,7 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <openssl/ssl.h>
 
 #include <event2/listener.h>
@@ -41,6 +42,22 @@ extern "C" {
 struct sockaddr;
 struct evwsconnlistener;
 struct evwsconn;
+struct evws_pool_stats;
+struct evws_sockopts;
+
+/** Statistics for a listener, see evwsconnlistener_get_stats() */
+struct evwsconnlistener_stats {
+  /**
+     Number of times the listener woke up to accept connections.  This is
+     only counted while accepts are capped by
+     evwsconnlistener_set_max_accepts(), and stays 0 otherwise, as
+     libevent's accept loop and io_uring report each connection but not
+     the wakeups
+   */
+  uint64_t wakeups;
+  /** Number of connections accepted */
+  uint64_t accepts;
+};
 
 /**
    A callback invoked when the listener has a new WebSocket connection
@@ -68,6 +85,26 @@ typedef void (*evwsconnlistener_cb)(struct evwsconnlistener *listener,
 typedef void (*evwsconnlistener_errorcb)(struct evwsconnlistener *listener,
     void *user_data);
 
+/**
+   A callback deciding whether an upgrade request received as TLS 1.3 early
+   data may be answered before the handshake completes.
+
+   Early data can be replayed by an attacker who captured it, so only
+   requests whose effects are safe to repeat should be allowed.  Requests
+   that are not allowed are answered once the handshake has completed.
+
+   @param listener The evwsconnlistener
+   @param request The HTTP upgrade request, not NUL-terminated
+   @param len The length of the request
+   @param address The source address of the connection
+   @param socklen The length of the address
+   @param user_data The pointer passed to evwsconnlistener_set_early_data
+   @return Nonzero to answer the request immediately
+ */
+typedef int (*evwsconnlistener_early_data_cb)(
+    struct evwsconnlistener *listener, const char *request, size_t len,
+    struct sockaddr *address, int socklen, void *user_data);
+
 /**
    Allocate a new evwsconnlistener object to listen for incoming WebSocket
    connections a given file descriptor.
@@ -125,6 +162,342 @@ struct evconnlistener *evconnlistener_get_evconnlistener(
 void evwsconnlistener_set_cb(struct evwsconnlistener *levws,
     evwsconnlistener_cb cb, void *user_data);
 
+/**
+   Offload TLS to the kernel (Linux kTLS) on new connections.
+
+   Once the TLS handshake and the WebSocket upgrade have completed, and the
+   kernel has accepted the session keys for both directions, the
+   connection's OpenSSL bufferevent is replaced by a plain socket
+   bufferevent.  Data is then encrypted and decrypted by the kernel, and
+   sendfile() can be used on the connection.  Connections for which the
+   kernel or OpenSSL build does not support kTLS, or the negotiated cipher,
+   stay on OpenSSL.
+
+   NOTE: Once offloaded, TLS control records sent by the client (e.g. a TLS
+   1.3 KeyUpdate) cannot be handled and close the connection, and no TLS
+   close notify is sent when the connection is freed.
+
+   @param levws The evwsconnlistener
+   @param enable Nonzero to enable kTLS offload
+ */
+void evwsconnlistener_set_ktls(struct evwsconnlistener *levws, int enable);
+
+/**
+   Adapt the TLS record size on new connections to how they are used.
+
+   After a connection has been idle for a second, data is sent in records
+   small enough to fit in one TCP segment, so a latency-sensitive message
+   can be decrypted as soon as its segment arrives.  Once a megabyte has
+   been sent without a pause, full 16 KB records are used for throughput.
+   The record size in use is reported by evwsconn_get_stats().  This has no
+   effect on connections without TLS or offloaded to kTLS.
+
+   @param levws The evwsconnlistener
+   @param enable Nonzero to enable TLS record sizing
+ */
+void evwsconnlistener_set_tls_record_sizing(struct evwsconnlistener *levws,
+    int enable);
+
+/**
+   Release per-connection buffers on connections that go idle.
+
+   When a new connection has received nothing for the given time, the
+   WebSocket parser state and its receive buffer are freed, provided no
+   message is partly received or waiting to be sent.  They are recreated
+   when the connection is next used.  TLS connections also release
+   OpenSSL's record buffers whenever they are empty.  This saves several
+   kilobytes per connection on servers holding many mostly idle ones.
+
+   Any read timeout set on the connection's bufferevent is replaced.
+
+   @param levws The evwsconnlistener
+   @param idle How long a connection must be idle, or NULL to disable
+ */
+void evwsconnlistener_set_idle_compaction(struct evwsconnlistener *levws,
+    const struct timeval *idle);
+
+/**
+   Read new connections' sockets directly rather than through a bufferevent.
+
+   Received data goes straight from the socket into the WebSocket parser,
+   so no input buffer is kept per connection and a copy is saved on every
+   read.  Combined with evwsconnlistener_set_idle_compaction(), an idle
+   connection holds no receive buffers at all.  This applies to
+   connections without TLS and to those moved onto kTLS.  Reading is then
+   disabled on the connection's bufferevent, which is still used for
+   writing.
+
+   @param levws The evwsconnlistener
+   @param enable Nonzero to enable direct reads
+ */
+void evwsconnlistener_set_direct_read(struct evwsconnlistener *levws,
+    int enable);
+
+/**
+   Run TLS handshakes and WebSocket upgrades on a pool of threads.
+
+   Each accepted socket is handed to one of nthreads threads, each running
+   its own event_base, so the key exchange doesn't stall established
+   connections on the listener's event_base.  Once the upgrade response has
+   been sent, the connection is handed back and created on the listener's
+   event_base as usual, and the listener's callback is invoked there.  The
+   listener's SSL_CTX and any session cache attached to it are used from
+   several threads.
+
+   This can be called once, before connections are accepted, and only on a
+   listener using TLS.  The threads are stopped by evwsconnlistener_free().
+
+   @param levws The evwsconnlistener
+   @param nthreads The number of handshake threads to start
+   @return 0 on success, -1 on failure
+ */
+int evwsconnlistener_set_handshake_threads(struct evwsconnlistener *levws,
+    int nthreads);
+
+/**
+   Accept TLS 1.3 early data carrying the WebSocket upgrade request.
+
+   Clients resuming a session can then send their upgrade request along
+   with the TLS handshake.  If cb allows it, the 101 response is sent
+   before the handshake completes and the connection is handed to the
+   listener's callback at once, saving a round trip.  WebSocket messages
+   the client sends in early data are only processed once the handshake
+   has completed.  Early data is only offered in sessions established
+   after this is set, and isn't used with handshake threads.
+
+   OpenSSL's own replay protection only accepts early data on stateful
+   sessions (SSL_OP_NO_TICKET).  With stateless tickets it rejects early
+   data unless SSL_OP_NO_ANTI_REPLAY is set on the SSL_CTX, leaving cb as
+   the only replay protection.
+
+   @param levws The evwsconnlistener
+   @param max_early_data The most early data a client may send, 0 to
+      disable early data
+   @param cb The replay policy, or NULL to always wait for the handshake
+   @param user_data A user-supplied pointer that will be passed to cb
+   @return 0 on success, -1 if the listener doesn't use TLS or OpenSSL
+      doesn't support early data
+ */
+int evwsconnlistener_set_early_data(struct evwsconnlistener *levws,
+    uint32_t max_early_data, evwsconnlistener_early_data_cb cb,
+    void *user_data);
+
+/**
+   Allocate a user area of the given size in the same block of memory as
+   each new connection, to be reached with evwsconn_get_userdata_area().
+   This saves a separate allocation for per-connection state.  It applies
+   to connections accepted after the call, so it should be set before
+   evwsconnlistener_prewarm().
+
+   @param levws The evwsconnlistener
+   @param size The size of the user area in bytes, or 0 for none
+ */
+void evwsconnlistener_set_userdata_size(struct evwsconnlistener *levws,
+    size_t size);
+
+/**
+   Preallocate pooled memory on the listener's event base so that count
+   connections can be accepted without calling malloc.  Pools are shared by
+   all listeners on an event base and never shrink.
+
+   @param levws The evwsconnlistener
+   @param count The number of connections to reserve memory for
+   @return 0 on success, -1 if the memory could not be allocated
+ */
+int evwsconnlistener_prewarm(struct evwsconnlistener *levws, size_t count);
+
+/**
+   Don't wake the listener for a new connection until the client has sent
+   data, i.e. its upgrade request or TLS ClientHello (TCP_DEFER_ACCEPT).
+
+   @param levws The evwsconnlistener
+   @param timeout_secs How long the kernel waits for data before waking the
+      listener anyway, 0 to disable
+   @return 0 on success, -1 on failure or if not supported
+ */
+int evwsconnlistener_set_defer_accept(struct evwsconnlistener *levws,
+    int timeout_secs);
+
+/**
+   Accept TCP Fast Open connections, whose first data arrives with the SYN.
+
+   @param levws The evwsconnlistener
+   @param qlen The most Fast Open connections waiting to be accepted, 0 to
+      disable
+   @return 0 on success, -1 on failure or if not supported
+ */
+int evwsconnlistener_set_fastopen(struct evwsconnlistener *levws, int qlen);
+
+/**
+   Limit how many connections are accepted each time the listener wakes.
+
+   By default the backlog is drained on every wakeup.  With a limit, the
+   rest of the backlog waits until the event loop has run the other pending
+   events, so a burst of new connections delays established ones less.
+   The underlying evconnlistener is disabled while a limit is set and must
+   not be re-enabled.
+
+   @param levws The evwsconnlistener
+   @param max The most connections to accept per wakeup, 0 for no limit
+   @return 0 on success, -1 on failure
+ */
+int evwsconnlistener_set_max_accepts(struct evwsconnlistener *levws,
+    int max);
+
+/**
+   Keep data that can't be sent soon in the library rather than the kernel.
+
+   New connections get TCP_NOTSENT_LOWAT set to bytes, so that the kernel
+   holds at most about that much data not yet sent.  Messages beyond that
+   are queued on the connection and only passed on as the socket drains.
+   On a slow link, messages that are out of date by the time they could
+   be sent are then not yet committed to the socket: the application can
+   watch evwsconn_stats.queued_bytes and use evwsconn_set_writable_cb() to
+   send only the latest state once the connection has caught up.
+
+   @param levws The evwsconnlistener
+   @param bytes The low mark in bytes, 0 to send without pacing
+ */
+void evwsconnlistener_set_notsent_lowat(struct evwsconnlistener *levws,
+    size_t bytes);
+
+/**
+   Split large messages into frames so that they don't hold up others.
+
+   Messages longer than max_frame_size given to evwsconn_send_message(),
+   evwsconn_send_message_ref(), evwsconn_send_buf() or evwsconn_send_file()
+   are sent as a series of frames of at most max_frame_size bytes each.
+   Frames are only passed to the bufferevent's output a few at a time, as
+   it drains, and the replies to pings are added ahead of those still
+   queued, so they are not delayed by a long message.  Messages split this
+   way are not sent with MSG_ZEROCOPY.  Messages sent with
+   evwsconngroup_broadcast(), evwsconngroup_broadcast_buf(),
+   evwsconn_send_messages() and evwsconn_commit() are exempt, and always
+   sent as single frames.
+
+   Combined with evwsconnlistener_set_notsent_lowat(), writes often end
+   part way through a segment, which Nagle's algorithm then holds back
+   until the client acknowledges earlier data; setting
+   EVWS_SOCKOPT_NODELAY with evwsconnlistener_set_sockopts() avoids this.
+
+   @param levws The evwsconnlistener
+   @param max_frame_size The largest frame payload, 0 to send every message
+      whole
+ */
+void evwsconnlistener_set_max_frame_size(struct evwsconnlistener *levws,
+    size_t max_frame_size);
+
+/**
+   Limit how much is written to each connection per event loop iteration.
+
+   libevent writes at most this many bytes to a connection each time its
+   socket becomes writable, so connections with a lot to send take turns
+   with the others rather than filling their socket buffers in one go.
+   libevent's default is 16 KB.
+
+   @param levws The evwsconnlistener
+   @param bytes The most bytes written per iteration, 0 for the default
+ */
+void evwsconnlistener_set_write_budget(struct evwsconnlistener *levws,
+    size_t bytes);
+
+/**
+   Limit how much is read from each connection per event loop iteration.
+
+   A connection stops reading once it has received bytes or messages
+   complete messages in one go, and is put at the back of a queue of
+   connections with input left.  Once per loop iteration, after polling,
+   every connection on the queue is read again up to the same limits, in
+   the order they were queued, so one busy client can't keep the loop from
+   the others.  A connection may receive a little more than bytes or
+   messages when wslay has already buffered the rest of a frame.
+
+   @param levws The evwsconnlistener
+   @param bytes The most bytes read per iteration, 0 for no limit
+   @param messages The most messages received per iteration, 0 for no limit
+ */
+void evwsconnlistener_set_read_budget(struct evwsconnlistener *levws,
+    size_t bytes, size_t messages);
+
+/**
+   Send large messages on plain connections with MSG_ZEROCOPY.
+
+   Messages of at least bytes given to evwsconn_send_message_ref() are
+   sent from the caller's memory instead of being copied into the kernel,
+   when nothing else is waiting to be sent on the connection.  Completion
+   is tracked on the socket's error queue.  Pinning the pages costs more
+   than copying a small message, so bytes should be large; the kernel
+   documentation suggests around 10 KB.  Connections using TLS, and
+   systems without SO_ZEROCOPY, send normally.
+
+   @param levws The evwsconnlistener
+   @param bytes The smallest message to send without copying, 0 to disable
+ */
+void evwsconnlistener_set_zerocopy(struct evwsconnlistener *levws,
+    size_t bytes);
+
+/**
+   Accept, receive and send through io_uring rather than libevent.
+
+   One multishot accept replaces the listener's accept loop, and plain
+   connections keep a multishot receive armed into a ring of buffers
+   shared by every connection on the event base, which are parsed in place.
+   Their output is sent as linked sends, and the requests made by all the
+   connections during an event loop iteration are submitted together, so
+   each connection costs no syscalls of its own to read or write.
+   Connections using TLS are only accepted this way.
+
+   Plain connections on io_uring don't use evwsconnlistener_set_zerocopy(),
+   evwsconnlistener_set_direct_read(), evwsconnlistener_set_write_budget()
+   or idle compaction, and files are mapped rather than sent with
+   sendfile().  Accepts are not capped by evwsconnlistener_set_max_accepts().
+   Their bufferevent must not be enabled for reading or writing.
+
+   Requires Linux 6.0 or later, and a library built with liburing.
+
+   @param levws The evwsconnlistener
+   @param enable 1 to use io_uring for new connections, 0 to stop
+   @return 0 on success, -1 if io_uring is not available
+ */
+int evwsconnlistener_set_io_uring(struct evwsconnlistener *levws,
+    int enable);
+
+/**
+   Set socket options on every connection the listener accepts.
+
+   The options are set as soon as a connection is accepted, so that they
+   also apply during the TLS and WebSocket handshakes.  Options can be
+   changed later on a single connection with evwsconn_set_sockopt().
+
+   @param levws The evwsconnlistener
+   @param opts The options, initialized with evws_sockopts_init(), or NULL
+      to set none
+ */
+void evwsconnlistener_set_sockopts(struct evwsconnlistener *levws,
+    const struct evws_sockopts *opts);
+
+/**
+   Get the listener's statistics.  Wakeups are only counted while accepts
+   are capped, see struct evwsconnlistener_stats.
+
+   @param levws The evwsconnlistener
+   @param stats Filled in with the listener's statistics
+ */
+void evwsconnlistener_get_stats(struct evwsconnlistener *levws,
+    struct evwsconnlistener_stats *stats);
+
+/**
+   Get the usage, including the high-water mark, of the memory pools on the
+   listener's event base.
+
+   @param levws The evwsconnlistener
+   @param stats An array to fill in, one entry per pool
+   @param max The number of entries in stats
+   @return The number of pools on the event base, which may be more than max
+ */
+int evwsconnlistener_get_pool_stats(struct evwsconnlistener *levws,
+    struct evws_pool_stats *stats, int max);
+
 /** Set an evwsconnlistener's error callback. */
 void evwsconnlistener_set_error_cb(struct evwsconnlistener *levws,
     evwsconnlistener_errorcb errorcb);
@@ -23,37 +23,87 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for accept4()
+#endif
+
 #include "evws/wslistener.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <openssl/err.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/buffer.h>
 
 #include "evws/evws.h"
 #include "evws-internal.h"
+#include "evws_pool.h"
 #include "evws_util.h"
 
+#ifdef EVWS_HAVE_URING
+#include <liburing.h>
+#endif
+
 #define MAX_HTTP_HEADER_SIZE 8192
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_TLS1_3)
+#define EVWS_HAVE_EARLY_DATA 1
+#endif
+
 struct evwspendingconn {
   struct evwsconnlistener* levws;
+  struct evws_pool* pool;
   struct bufferevent* bev;
-  struct sockaddr *address;
+  struct sockaddr_storage address;
   int socklen;
   struct evwspendingconn* next;
+  // set while reading TLS early data, before the bufferevent exists
+  struct event* early_ev;
+  SSL* ssl;
+  evutil_socket_t fd;
+  struct evbuffer* early_data;
+  int early_state;
+  int early_finished;
+  const char* subprotocol;
 };
 
+struct evwsuringaccept;
+
 struct evwsconnlistener {
   struct evconnlistener* lev;
+  struct evwsbase* wsbase;
+  struct evws_pool* pending_pool;
   evwsconnlistener_cb cb;
   evwsconnlistener_errorcb errorcb;
   void* user_data;
   const char** supported_subprotocols;
   SSL_CTX* server_ctx;
+  struct evwsconn_config conn_config;
   struct evwspendingconn* head;
+  struct evwshsworker* hs_workers;
+  int hs_nworkers;
+  int hs_next_worker;
+  pthread_mutex_t hs_lock;
+  // finished handshakes waiting for the listener's loop, guarded by hs_lock
+  struct evwshandshake* hs_done;
+  struct event* hs_done_ev;
+  evutil_socket_t hs_notify[2];
+  uint32_t max_early_data;
+  evwsconnlistener_early_data_cb early_data_cb;
+  void* early_data_arg;
+  // own accept loop, used instead of libevent's when accepts are capped
+  struct event* accept_ev;
+  int max_accepts;
+  // multishot accept on the base's io_uring, used instead of both
+  struct evwsuringaccept* uring_accept;
+  struct evwsconnlistener_stats stats;
+  int has_sockopts;
+  struct evws_sockopts sockopts;
 };
 
 static void remove_pending(struct evwspendingconn* pending) {
@@ -76,65 +126,102 @@ static void remove_pending(struct evwspendingconn* pending) {
 static void free_pending(struct evwspendingconn* pending) {
   if (pending->bev)
     bufferevent_free(pending->bev);
-  free(pending->address);
-  free(pending);
+  if (pending->early_ev)
+    event_free(pending->early_ev);
+  if (pending->ssl)
+    SSL_free(pending->ssl);
+  if (pending->fd >= 0)
+    evutil_closesocket(pending->fd);
+  if (pending->early_data)
+    evbuffer_free(pending->early_data);
+  evws_pool_free(pending->pool, pending);
 }
 
-static void pending_read(struct bufferevent *bev, void *pending_ptr) {
-  struct evwspendingconn* pending = (struct evwspendingconn *)pending_ptr;
-  struct evbuffer* input = bufferevent_get_input(pending->bev);
+/*
+ * Parse the upgrade request at the start of input and add the 101 response
+ * to output.  Returns 1 if the full request has not arrived yet, -1 if the
+ * connection should be dropped, 0 once the response is added.  Anything
+ * the client sent after the request is left in input.
+ */
+static int upgrade_connection(struct evwsconnlistener* levws,
+    struct evbuffer* input, struct evbuffer* output,
+    const char** subprotocol) {
   struct evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
   size_t len = evbuffer_get_length(input);
 
   if (end.pos == -1) {
     if (len > MAX_HTTP_HEADER_SIZE) {
-      remove_pending(pending);
-      free_pending(pending);
+      return -1;
     }
-    return; // full request not yet found
+    return 1; // full request not yet found
   }
+  len = end.pos + 4;
 
   unsigned char* data = evbuffer_pullup(input, len);
   char accept_key[29];
 
-  struct evwsconnlistener* levws = pending->levws;
-  const char* subprotocol = NULL;
+  *subprotocol = NULL;
   if (evaluate_websocket_handshake((char*)data, len,
-      levws->supported_subprotocols, accept_key, &subprotocol)) {
-    remove_pending(pending);
-    free_pending(pending);
-    return;
+      levws->supported_subprotocols, accept_key, subprotocol)) {
+    return -1;
   }
 
   evbuffer_drain(input, len);
 
-  bufferevent_setcb(pending->bev, NULL, NULL, NULL, pending);
-
-  struct evbuffer* output = bufferevent_get_output(pending->bev);
   evbuffer_add_printf(output,
       "HTTP/1.1 101 Switching Protocols\r\n"
       "Upgrade: websocket\r\n"
       "Connection: Upgrade\r\n"
       "Sec-WebSocket-Accept: %s\r\n", accept_key);
 
-  if (subprotocol != NULL) {
+  if (*subprotocol != NULL) {
     evbuffer_add_printf(output, "Sec-WebSocket-Protocol: %s\r\n\r\n",
-        subprotocol);
+        *subprotocol);
   } else {
     evbuffer_add_printf(output, "\r\n");
   }
+  return 0;
+}
+
+/* Hand an upgraded bufferevent to a new connection, -1 if bev was freed */
+static struct evwsconn* accept_connection(struct evwsconnlistener* levws,
+    struct bufferevent* bev, const char* subprotocol,
+    struct sockaddr* address, int socklen) {
+  struct evwsconn *wsconn = evwsconn_new(levws->wsbase, bev, subprotocol,
+      &levws->conn_config);
+  if (wsconn == NULL) {
+    bufferevent_free(bev);
+    return NULL;
+  }
+  levws->cb(levws, wsconn, address, socklen, levws->user_data);
+  return wsconn;
+}
 
+static void pending_read(struct bufferevent *bev, void *pending_ptr) {
+  struct evwspendingconn* pending = (struct evwspendingconn *)pending_ptr;
+  struct evwsconnlistener* levws = pending->levws;
+  const char* subprotocol;
+  int ret = upgrade_connection(levws, bufferevent_get_input(pending->bev),
+      bufferevent_get_output(pending->bev), &subprotocol);
+  if (ret > 0) {
+    return;
+  }
   remove_pending(pending);
-  struct evwsconn *wsconn = evwsconn_new(pending->bev, subprotocol);
+  if (ret < 0) {
+    free_pending(pending);
+    return;
+  }
+
+  bufferevent_setcb(pending->bev, NULL, NULL, NULL, pending);
+  struct bufferevent* conn_bev = pending->bev;
   pending->bev = NULL;
-  levws->cb(levws, wsconn, pending->address, pending->socklen,
-      levws->user_data);
+  accept_connection(levws, conn_bev, subprotocol,
+      (struct sockaddr *)&pending->address, pending->socklen);
   free_pending(pending);
 }
 
-static void pending_event(struct bufferevent *bev, short events,
-    void *pending_ptr) {
-  struct evwspendingconn* pending = (struct evwspendingconn *)pending_ptr;
+/* Log why a connection failed before its upgrade, 0 if it didn't */
+static int report_pending_event(struct bufferevent *bev, short events) {
   if (events & BEV_EVENT_EOF) {
     fprintf(stderr, "Connection closed\n");
   } else if (events & BEV_EVENT_ERROR) {
@@ -152,40 +239,522 @@ static void pending_event(struct bufferevent *bev, short events,
           ERR_error_string(ssl_error, NULL));
     }
   } else if (events & BEV_EVENT_CONNECTED) {
-    return; // SSL connected
+    return 0; // SSL connected
   } else {
     fprintf(stderr, "Unknown event: %x\n", (int)events);
   }
+  return 1;
+}
+
+static void pending_event(struct bufferevent *bev, short events,
+    void *pending_ptr) {
+  struct evwspendingconn* pending = (struct evwspendingconn *)pending_ptr;
+  if (!report_pending_event(bev, events)) {
+    return;
+  }
+  remove_pending(pending);
+  free_pending(pending);
+}
+
+static SSL* new_client_ssl(struct evwsconnlistener* levws) {
+  SSL *client_ctx = SSL_new(levws->server_ctx);
+  if (client_ctx == NULL) {
+    fprintf(stderr, "Unable to get client_ctx\n");
+    exit(-1);
+  }
+  if (levws->conn_config.idle_timeout)
+    SSL_set_mode(client_ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (levws->conn_config.ktls)
+    SSL_set_options(client_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  return client_ctx;
+}
+
+/*
+ * Handshake threads.  A TLS listener with handshake threads passes each
+ * accepted socket to one of them, round robin.  The thread runs the TLS
+ * handshake and the WebSocket upgrade on its own event_base, on a
+ * bufferevent that neither closes the socket nor frees the SSL.  Once the
+ * 101 response has been written, that bufferevent is freed and the socket,
+ * the SSL and any data received after the upgrade request are queued back
+ * to the listener's loop, which wraps them in a new bufferevent and creates
+ * the connection.  The queues are protected by mutexes and each side is
+ * woken through a socketpair, so neither event_base needs libevent's
+ * locking.
+ */
+struct evwshandshake {
+  struct evwshsworker* worker;
+  struct bufferevent* bev;
+  evutil_socket_t fd;
+  SSL* ssl;
+  struct evbuffer* leftover;
+  const char* subprotocol;
+  struct sockaddr_storage address;
+  int socklen;
+  struct evwshandshake* next;
+};
+
+struct evwshsworker {
+  struct evwsconnlistener* levws;
+  pthread_t thread;
+  struct event_base* base;
+  struct event* notify_ev;
+  evutil_socket_t notify[2];
+  int stop;
+  // sockets waiting to be picked up by the thread, guarded by levws->hs_lock
+  struct evwshandshake* queue;
+  // handshakes in progress, only touched by the thread
+  struct evwshandshake* head;
+};
+
+static void notify(evutil_socket_t fd) {
+  char c = 0;
+  if (send(fd, &c, 1, 0) < 0) {
+    // the other side is already woken if the socket is full
+  }
+}
+
+static void drain_notify(evutil_socket_t fd) {
+  char buf[64];
+  while (recv(fd, buf, sizeof(buf), 0) > 0) {
+  }
+}
+
+static void free_handshake(struct evwshandshake* hs) {
+  if (hs->bev)
+    bufferevent_free(hs->bev);
+  if (hs->ssl)
+    SSL_free(hs->ssl);
+  if (hs->leftover)
+    evbuffer_free(hs->leftover);
+  if (hs->fd >= 0)
+    evutil_closesocket(hs->fd);
+  evws_free(hs);
+}
+
+static void remove_handshake(struct evwshandshake* hs) {
+  struct evwshandshake** curr = &hs->worker->head;
+  while (*curr && *curr != hs)
+    curr = &(*curr)->next;
+  if (*curr)
+    *curr = hs->next;
+}
+
+static void handshake_done(struct evwshandshake* hs) {
+  struct evwsconnlistener* levws = hs->worker->levws;
+  remove_handshake(hs);
+  hs->leftover = evbuffer_new();
+  if (hs->leftover == NULL ||
+      evbuffer_add_buffer(hs->leftover, bufferevent_get_input(hs->bev)) < 0) {
+    free_handshake(hs);
+    return;
+  }
+  bufferevent_free(hs->bev);
+  hs->bev = NULL;
+  pthread_mutex_lock(&levws->hs_lock);
+  hs->next = levws->hs_done;
+  levws->hs_done = hs;
+  if (hs->next == NULL)
+    notify(levws->hs_notify[1]);
+  pthread_mutex_unlock(&levws->hs_lock);
+}
+
+static void handshake_write(struct bufferevent *bev, void *hs_ptr) {
+  // the 101 response has been written
+  handshake_done((struct evwshandshake *)hs_ptr);
+}
+
+static void handshake_event(struct bufferevent *bev, short events,
+    void *hs_ptr) {
+  struct evwshandshake* hs = (struct evwshandshake *)hs_ptr;
+  if (!report_pending_event(bev, events)) {
+    return;
+  }
+  remove_handshake(hs);
+  free_handshake(hs);
+}
+
+static void handshake_read(struct bufferevent *bev, void *hs_ptr) {
+  struct evwshandshake* hs = (struct evwshandshake *)hs_ptr;
+  int ret = upgrade_connection(hs->worker->levws, bufferevent_get_input(bev),
+      bufferevent_get_output(bev), &hs->subprotocol);
+  if (ret > 0) {
+    return;
+  }
+  if (ret < 0) {
+    remove_handshake(hs);
+    free_handshake(hs);
+    return;
+  }
+  bufferevent_disable(bev, EV_READ);
+  bufferevent_setcb(bev, NULL, handshake_write, handshake_event, hs);
+}
+
+static void worker_notify_cb(evutil_socket_t fd, short events,
+    void *worker_ptr) {
+  struct evwshsworker* worker = (struct evwshsworker *)worker_ptr;
+  struct evwsconnlistener* levws = worker->levws;
+  drain_notify(fd);
+  pthread_mutex_lock(&levws->hs_lock);
+  struct evwshandshake* queue = worker->queue;
+  worker->queue = NULL;
+  if (worker->stop)
+    event_base_loopbreak(worker->base);
+  pthread_mutex_unlock(&levws->hs_lock);
+  while (queue) {
+    struct evwshandshake* hs = queue;
+    queue = hs->next;
+    hs->ssl = new_client_ssl(levws);
+    hs->bev = bufferevent_openssl_socket_new(worker->base, hs->fd, hs->ssl,
+        BUFFEREVENT_SSL_ACCEPTING, 0);
+    if (hs->bev == NULL) {
+      free_handshake(hs);
+      continue;
+    }
+    bufferevent_setcb(hs->bev, handshake_read, NULL, handshake_event, hs);
+    bufferevent_enable(hs->bev, EV_READ);
+    hs->next = worker->head;
+    worker->head = hs;
+  }
+}
+
+static void* worker_main(void* worker_ptr) {
+  struct evwshsworker* worker = (struct evwshsworker *)worker_ptr;
+  event_base_dispatch(worker->base);
+  while (worker->head) {
+    struct evwshandshake* hs = worker->head;
+    worker->head = hs->next;
+    free_handshake(hs);
+  }
+  // let libevent finish freeing the bufferevents
+  event_base_loop(worker->base, EVLOOP_NONBLOCK);
+  return NULL;
+}
+
+static void handshakes_done_cb(evutil_socket_t fd, short events,
+    void *levws_ptr) {
+  struct evwsconnlistener* levws = (struct evwsconnlistener *)levws_ptr;
+  struct event_base *base = evwsbase_get_base(levws->wsbase);
+  drain_notify(fd);
+  pthread_mutex_lock(&levws->hs_lock);
+  struct evwshandshake* done = levws->hs_done;
+  levws->hs_done = NULL;
+  pthread_mutex_unlock(&levws->hs_lock);
+  while (done) {
+    struct evwshandshake* hs = done;
+    done = hs->next;
+    struct bufferevent* bev = bufferevent_openssl_socket_new(base, hs->fd,
+        hs->ssl, BUFFEREVENT_SSL_OPEN, BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL) {
+      free_handshake(hs);
+      continue;
+    }
+    hs->ssl = NULL;
+    hs->fd = -1;
+    // the connection can't go on without what the client sent after its
+    // upgrade request
+    if (evbuffer_add_buffer(bufferevent_get_input(bev), hs->leftover) < 0) {
+      bufferevent_free(bev);
+      free_handshake(hs);
+      continue;
+    }
+    bufferevent_enable(bev, EV_READ);
+    struct evwsconn* wsconn = accept_connection(levws, bev, hs->subprotocol,
+        (struct sockaddr *)&hs->address, hs->socklen);
+    free_handshake(hs);
+    // the thread has already written the 101 response, so no write will
+    // come to trigger the switch
+    if (wsconn != NULL)
+      evwsconn_start_ktls(wsconn);
+  }
+}
+
+static void free_handshake_threads(struct evwsconnlistener* levws) {
+  int i;
+  for (i = 0; i < levws->hs_nworkers; i++) {
+    struct evwshsworker* worker = &levws->hs_workers[i];
+    if (worker->base == NULL)
+      continue;
+    pthread_mutex_lock(&levws->hs_lock);
+    worker->stop = 1;
+    notify(worker->notify[1]);
+    pthread_mutex_unlock(&levws->hs_lock);
+    pthread_join(worker->thread, NULL);
+    while (worker->queue) {
+      struct evwshandshake* hs = worker->queue;
+      worker->queue = hs->next;
+      free_handshake(hs);
+    }
+    event_free(worker->notify_ev);
+    event_base_free(worker->base);
+    evutil_closesocket(worker->notify[0]);
+    evutil_closesocket(worker->notify[1]);
+  }
+  while (levws->hs_done) {
+    struct evwshandshake* hs = levws->hs_done;
+    levws->hs_done = hs->next;
+    free_handshake(hs);
+  }
+  if (levws->hs_done_ev) {
+    event_free(levws->hs_done_ev);
+    evutil_closesocket(levws->hs_notify[0]);
+    evutil_closesocket(levws->hs_notify[1]);
+  }
+  if (levws->hs_workers)
+    pthread_mutex_destroy(&levws->hs_lock);
+  evws_free(levws->hs_workers);
+  levws->hs_workers = NULL;
+  levws->hs_nworkers = 0;
+}
+
+static int new_notify_pair(evutil_socket_t pair[2]) {
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    return -1;
+  evutil_make_socket_nonblocking(pair[0]);
+  evutil_make_socket_nonblocking(pair[1]);
+  return 0;
+}
+
+static void offload_handshake(struct evwsconnlistener* levws,
+    evutil_socket_t fd, struct sockaddr *address, int socklen) {
+  struct evwshandshake *hs =
+      (struct evwshandshake *)evws_malloc(sizeof(struct evwshandshake));
+  if (hs == NULL) {
+    evutil_closesocket(fd);
+    return;
+  }
+  memset(hs, 0, sizeof(struct evwshandshake));
+  hs->worker = &levws->hs_workers[levws->hs_next_worker];
+  levws->hs_next_worker = (levws->hs_next_worker + 1) % levws->hs_nworkers;
+  hs->fd = fd;
+  if (socklen > sizeof(hs->address))
+    socklen = sizeof(hs->address);
+  memcpy(&hs->address, address, socklen);
+  hs->socklen = socklen;
+  pthread_mutex_lock(&levws->hs_lock);
+  hs->next = hs->worker->queue;
+  hs->worker->queue = hs;
+  if (hs->next == NULL)
+    notify(hs->worker->notify[1]);
+  pthread_mutex_unlock(&levws->hs_lock);
+}
+
+#ifdef EVWS_HAVE_EARLY_DATA
+/*
+ * TLS 1.3 early data.  Until the client's early data has been read, the
+ * SSL is driven directly with SSL_read_early_data() on an event of our
+ * own, since the OpenSSL bufferevent only knows about full handshakes.
+ * If the upgrade request arrives in early data and the listener's policy
+ * allows it, the 101 response is sent right away as 0.5-RTT data.
+ * Otherwise the request is kept until the handshake completes, which
+ * proves the client is not replaying it.  The handshake is then finished
+ * on the same event and the connection moved to an OpenSSL bufferevent.
+ */
+enum {
+  EARLY_WAITING,
+  EARLY_UPGRADED,
+  EARLY_DEFERRED
+};
+
+static int early_upgrade(struct evwspendingconn* pending) {
+  struct evwsconnlistener* levws = pending->levws;
+  struct evbuffer* early_data = pending->early_data;
+  struct evbuffer_ptr end = evbuffer_search(early_data, "\r\n\r\n", 4, NULL);
+  if (end.pos == -1) {
+    return evbuffer_get_length(early_data) > MAX_HTTP_HEADER_SIZE ? -1 : 0;
+  }
+  size_t len = end.pos + 4;
+  if (levws->early_data_cb == NULL ||
+      !levws->early_data_cb(levws, (char*)evbuffer_pullup(early_data, len),
+          len, (struct sockaddr *)&pending->address, pending->socklen,
+          levws->early_data_arg)) {
+    pending->early_state = EARLY_DEFERRED;
+    return 0;
+  }
+  struct evbuffer* output = evbuffer_new();
+  if (output == NULL ||
+      upgrade_connection(levws, early_data, output, &pending->subprotocol)) {
+    if (output)
+      evbuffer_free(output);
+    return -1;
+  }
+  len = evbuffer_get_length(output);
+  size_t written = 0;
+  int ret = SSL_write_early_data(pending->ssl, evbuffer_pullup(output, len),
+      len, &written);
+  evbuffer_free(output);
+  if (!ret || written != len) {
+    return -1;
+  }
+  pending->early_state = EARLY_UPGRADED;
+  return 0;
+}
+
+static void end_early_data(struct evwspendingconn* pending) {
+  struct evwsconnlistener* levws = pending->levws;
+  struct event_base *base = evconnlistener_get_base(levws->lev);
+  event_free(pending->early_ev);
+  pending->early_ev = NULL;
+  pending->bev = bufferevent_openssl_socket_new(base, pending->fd,
+      pending->ssl, BUFFEREVENT_SSL_OPEN, BEV_OPT_CLOSE_ON_FREE);
+  if (pending->bev == NULL) {
+    remove_pending(pending);
+    free_pending(pending);
+    return;
+  }
+  pending->ssl = NULL;
+  pending->fd = -1;
+  evbuffer_add_buffer(bufferevent_get_input(pending->bev),
+      pending->early_data);
+  struct bufferevent* bev = pending->bev;
+  if (pending->early_state == EARLY_UPGRADED) {
+    remove_pending(pending);
+    pending->bev = NULL;
+    // an SSL bufferevent created open only has writing enabled
+    bufferevent_enable(bev, EV_READ);
+    struct evwsconn* wsconn = accept_connection(levws, bev,
+        pending->subprotocol, (struct sockaddr *)&pending->address,
+        pending->socklen);
+    free_pending(pending);
+    if (wsconn == NULL) {
+      return;
+    }
+  } else {
+    bufferevent_setcb(bev, pending_read, NULL, pending_event, pending);
+    bufferevent_enable(bev, EV_READ);
+  }
+  // process whatever the client sent in early data
+  bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+static void pending_early_read(evutil_socket_t fd, short events,
+    void *pending_ptr);
+
+/* Wait for the socket as OpenSSL asks, 0 if it failed for another reason */
+static int wait_early(struct evwspendingconn* pending, int ret) {
+  int err = SSL_get_error(pending->ssl, ret);
+  if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+    return 0;
+  }
+  event_assign(pending->early_ev, event_get_base(pending->early_ev),
+      pending->fd, err == SSL_ERROR_WANT_READ ? EV_READ : EV_WRITE,
+      pending_early_read, pending);
+  event_add(pending->early_ev, NULL);
+  return 1;
+}
+
+static void pending_early_read(evutil_socket_t fd, short events,
+    void *pending_ptr) {
+  struct evwspendingconn* pending = (struct evwspendingconn *)pending_ptr;
+  unsigned char buf[4096];
+  int ret;
+  while (!pending->early_finished) {
+    size_t len = 0;
+    ret = SSL_read_early_data(pending->ssl, buf, sizeof(buf), &len);
+    if (ret == SSL_READ_EARLY_DATA_ERROR) {
+      if (wait_early(pending, ret))
+        return;
+      goto err;
+    }
+    if (len > 0 && evbuffer_add(pending->early_data, buf, len) < 0) {
+      goto err;
+    }
+    if (pending->early_state == EARLY_WAITING && early_upgrade(pending) < 0) {
+      goto err;
+    }
+    if (ret == SSL_READ_EARLY_DATA_FINISH) {
+      pending->early_finished = 1;
+    }
+  }
+  // the bufferevent can't pick up a handshake in progress, so finish it here
+  ret = SSL_do_handshake(pending->ssl);
+  if (ret == 1) {
+    end_early_data(pending);
+    return;
+  }
+  if (wait_early(pending, ret))
+    return;
 
+err:
+  ERR_clear_error();
   remove_pending(pending);
   free_pending(pending);
 }
 
+static int start_early_data(struct evwspendingconn* pending,
+    struct event_base* base, evutil_socket_t fd, SSL* ssl) {
+  pending->early_data = evbuffer_new();
+  if (pending->early_data == NULL || !SSL_set_fd(ssl, fd) ||
+      !SSL_set_max_early_data(ssl, pending->levws->max_early_data)) {
+    return -1;
+  }
+  SSL_set_accept_state(ssl);
+  pending->early_ev = event_new(base, fd, EV_READ, pending_early_read,
+      pending);
+  if (pending->early_ev == NULL ||
+      event_add(pending->early_ev, NULL) < 0) {
+    return -1;
+  }
+  pending->ssl = ssl;
+  pending->fd = fd;
+  pending->early_state = EARLY_WAITING;
+  return 0;
+}
+#endif
+
 static void lev_cb(struct evconnlistener *evlistener,
     evutil_socket_t fd, struct sockaddr *address, int socklen,
     void *levws_ptr) {
   struct evwsconnlistener* levws = (struct evwsconnlistener *)levws_ptr;
   struct event_base *base = evconnlistener_get_base(levws->lev);
 
+  // applied before the handshake, which the options should already cover
+  if (levws->has_sockopts)
+    evws_apply_sockopts(fd, &levws->sockopts);
+
+  levws->stats.accepts++;
+  if (levws->hs_nworkers > 0) {
+    offload_handshake(levws, fd, address, socklen);
+    return;
+  }
+
   struct evwspendingconn *pending =
-      (struct evwspendingconn *)malloc(sizeof(struct evwspendingconn));
+      (struct evwspendingconn *)evws_pool_alloc(levws->pending_pool);
+  if (pending == NULL) {
+    evutil_closesocket(fd);
+    return;
+  }
+  memset(pending, 0, sizeof(struct evwspendingconn));
   pending->levws = levws;
+  pending->pool = levws->pending_pool;
+  pending->fd = -1;
+  if (socklen > sizeof(pending->address))
+    socklen = sizeof(pending->address);
+  memcpy(&pending->address, address, socklen);
+  pending->socklen = socklen;
   if (levws->server_ctx == NULL) {
     pending->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
   } else {
-    SSL *client_ctx = SSL_new(levws->server_ctx);
-    if (client_ctx == NULL) {
-      fprintf(stderr, "Unable to get client_ctx\n");
-      exit(-1);
+    SSL *client_ctx = new_client_ssl(levws);
+#ifdef EVWS_HAVE_EARLY_DATA
+    if (levws->max_early_data > 0) {
+      if (start_early_data(pending, base, fd, client_ctx) < 0) {
+        SSL_free(client_ctx);
+        pending->fd = fd;
+        free_pending(pending);
+        return;
+      }
+      pending->next = levws->head;
+      levws->head = pending;
+      return;
     }
+#endif
     pending->bev = bufferevent_openssl_socket_new(base, fd, client_ctx,
         BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
   }
   bufferevent_setcb(pending->bev, pending_read, NULL, pending_event, pending);
   bufferevent_enable(pending->bev, EV_READ);
-  pending->address = (struct sockaddr *)malloc(socklen);
-  memcpy(pending->address, address, socklen);
-  pending->socklen = socklen;
   pending->next = levws->head;
   levws->head = pending;
 }
@@ -196,25 +765,193 @@ static void lev_error_cb(struct evconnlistener *evlistener, void* levws_ptr) {
     levws->errorcb(levws, levws->user_data);
 }
 
-struct evwsconnlistener *evwsconnlistener_new(struct event_base *base,
-    evwsconnlistener_cb cb, void *user_data, unsigned flags, int backlog,
-    const char* subprotocols[], SSL_CTX* server_ctx, evutil_socket_t fd) {
+/*
+ * libevent accepts until the backlog is empty on every wakeup, which can
+ * starve established connections during a connection storm.  With a cap,
+ * this loop replaces libevent's and leaves the rest of the backlog for the
+ * next loop iteration, after other events have run.
+ */
+static void accept_cb(evutil_socket_t lfd, short events, void *levws_ptr) {
+  struct evwsconnlistener* levws = (struct evwsconnlistener *)levws_ptr;
+  int i;
+  levws->stats.wakeups++;
+  for (i = 0; i < levws->max_accepts; i++) {
+    struct sockaddr_storage address;
+    socklen_t socklen = sizeof(address);
+#ifdef SOCK_NONBLOCK
+    evutil_socket_t fd = accept4(lfd, (struct sockaddr *)&address, &socklen,
+        SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    evutil_socket_t fd = accept(lfd, (struct sockaddr *)&address, &socklen);
+    if (fd >= 0) {
+      evutil_make_socket_nonblocking(fd);
+      evutil_make_socket_closeonexec(fd);
+    }
+#endif
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED)
+        lev_error_cb(levws->lev, levws);
+      return;
+    }
+    lev_cb(levws->lev, fd, (struct sockaddr *)&address, socklen, levws);
+  }
+}
+
+#ifdef EVWS_HAVE_URING
+// Accept through libevent again, with or without the cap
+static void accept_normally(struct evwsconnlistener* levws) {
+  if (levws->accept_ev)
+    event_add(levws->accept_ev, NULL);
+  else
+    evconnlistener_enable(levws->lev);
+}
+
+/*
+ * A single multishot accept stays armed on the listening socket and
+ * completes once for every connection, without a wakeup or accept() call
+ * of its own.  It ends when the listener is freed or io_uring is turned
+ * off, and outlives the listener until its last completion.  Accepts made
+ * this way aren't capped by evwsconnlistener_set_max_accepts().
+ */
+struct evwsuringaccept {
+  struct evwsuring_op op;
+  struct evwsuring_orphan orphan;
+  // NULL once accepting through the ring has stopped
+  struct evwsconnlistener* levws;
+  struct evwsuring* ring;
+  evutil_socket_t fd;
+  int armed;
+};
+
+static int arm_accept(struct evwsuringaccept* ua) {
+  struct io_uring_sqe* sqe = evwsuring_get_sqe(ua->ring, &ua->op);
+  if (!sqe)
+    return -1;
+  io_uring_prep_multishot_accept(sqe, ua->fd, NULL, NULL,
+      SOCK_NONBLOCK|SOCK_CLOEXEC);
+  ua->armed = 1;
+  return 0;
+}
+
+static void free_accept(struct evwsuring_orphan* orphan) {
+  evws_free((char*)orphan - offsetof(struct evwsuringaccept, orphan));
+}
+
+static void release_accept(struct evwsuringaccept* ua) {
+  if (ua->levws || ua->armed)
+    return;
+  evwsuring_disown(ua->ring, &ua->orphan);
+  evws_free(ua);
+}
+
+static void uring_accept_done(struct evwsuring_op* op, int res,
+    unsigned int flags) {
+  struct evwsuringaccept* ua = (struct evwsuringaccept*)op;
+  if (!(flags & IORING_CQE_F_MORE))
+    ua->armed = 0;
+  if (res >= 0 && ua->levws) {
+    struct sockaddr_storage address;
+    socklen_t socklen = sizeof(address);
+    if (getpeername(res, (struct sockaddr *)&address, &socklen) < 0)
+      evutil_closesocket(res); // already reset by the client
+    else
+      lev_cb(ua->levws->lev, res, (struct sockaddr *)&address, socklen,
+          ua->levws);
+  } else if (res >= 0) {
+    evutil_closesocket(res);
+  } else if (ua->levws && res != -EAGAIN && res != -EINTR &&
+      res != -ECONNABORTED && res != -ECANCELED) {
+    lev_error_cb(ua->levws->lev, ua->levws);
+  }
+  // the callbacks may have freed the listener
+  if (!ua->levws) {
+    release_accept(ua);
+  } else if (!ua->armed && arm_accept(ua) < 0) {
+    struct evwsconnlistener* levws = ua->levws;
+    levws->uring_accept = NULL;
+    ua->levws = NULL;
+    evws_free(ua);
+    accept_normally(levws);
+  }
+}
+
+/*
+ * The cancel is submitted now, while the listening socket is still open,
+ * as its descriptor may be reused once the listener closes it.
+ */
+static void stop_uring_accept(struct evwsconnlistener* levws) {
+  struct evwsuringaccept* ua = levws->uring_accept;
+  levws->uring_accept = NULL;
+  ua->levws = NULL;
+  if (ua->armed) {
+    evwsuring_cancel(ua->ring, &ua->op);
+    evwsuring_submit(ua->ring);
+  }
+  evwsuring_adopt(ua->ring, &ua->orphan);
+  release_accept(ua);
+}
+#endif
+
+static struct evwsconnlistener *listener_new(struct event_base *base,
+    evwsconnlistener_cb cb, void *user_data, const char* subprotocols[],
+    SSL_CTX* server_ctx) {
   struct evwsconnlistener *levws =
-      (struct evwsconnlistener *)malloc(sizeof(struct evwsconnlistener));
+      (struct evwsconnlistener *)evws_malloc(
+          sizeof(struct evwsconnlistener));
   if (!levws)
     return NULL;
 
-  levws->lev = evconnlistener_new(base, lev_cb, levws, flags, backlog, fd);
-  if (!levws->lev) {
-    free(levws);
+  levws->wsbase = evwsbase_get(base);
+  if (!levws->wsbase) {
+    evws_free(levws);
+    return NULL;
+  }
+  levws->pending_pool = evwsbase_get_pool(levws->wsbase,
+      sizeof(struct evwspendingconn), 0);
+  if (!levws->pending_pool) {
+    evwsbase_decref(levws->wsbase);
+    evws_free(levws);
     return NULL;
   }
+  levws->lev = NULL;
   levws->cb = cb;
   levws->errorcb = NULL;
   levws->user_data = user_data;
   levws->supported_subprotocols = subprotocols;
   levws->server_ctx = server_ctx;
+  memset(&levws->conn_config, 0, sizeof(levws->conn_config));
   levws->head = NULL;
+  levws->hs_workers = NULL;
+  levws->hs_nworkers = 0;
+  levws->hs_next_worker = 0;
+  levws->hs_done = NULL;
+  levws->hs_done_ev = NULL;
+  levws->max_early_data = 0;
+  levws->early_data_cb = NULL;
+  levws->early_data_arg = NULL;
+  levws->accept_ev = NULL;
+  levws->max_accepts = 0;
+  levws->uring_accept = NULL;
+  memset(&levws->stats, 0, sizeof(levws->stats));
+  levws->has_sockopts = 0;
+
+  return levws;
+}
+
+struct evwsconnlistener *evwsconnlistener_new(struct event_base *base,
+    evwsconnlistener_cb cb, void *user_data, unsigned flags, int backlog,
+    const char* subprotocols[], SSL_CTX* server_ctx, evutil_socket_t fd) {
+  struct evwsconnlistener *levws = listener_new(base, cb, user_data,
+      subprotocols, server_ctx);
+  if (!levws)
+    return NULL;
+
+  levws->lev = evconnlistener_new(base, lev_cb, levws, flags, backlog, fd);
+  if (!levws->lev) {
+    evwsconnlistener_free(levws);
+    return NULL;
+  }
 
   return levws;
 }
@@ -223,23 +960,17 @@ struct evwsconnlistener *evwsconnlistener_new_bind(struct event_base *base,
     evwsconnlistener_cb cb, void *user_data, unsigned flags, int backlog,
     const char* subprotocols[], SSL_CTX* server_ctx,
     const struct sockaddr *addr, int socklen) {
-  struct evwsconnlistener *levws =
-      (struct evwsconnlistener *)malloc(sizeof(struct evwsconnlistener));
+  struct evwsconnlistener *levws = listener_new(base, cb, user_data,
+      subprotocols, server_ctx);
   if (!levws)
     return NULL;
 
   levws->lev = evconnlistener_new_bind(base, lev_cb, levws, flags, backlog,
       addr, socklen);
   if (!levws->lev) {
-    free(levws);
+    evwsconnlistener_free(levws);
     return NULL;
   }
-  levws->cb = cb;
-  levws->errorcb = NULL;
-  levws->user_data = user_data;
-  levws->supported_subprotocols = subprotocols;
-  levws->server_ctx = server_ctx;
-  levws->head = NULL;
 
   return levws;
 }
@@ -254,8 +985,17 @@ void evwsconnlistener_free(struct evwsconnlistener *levws) {
     curr = curr->next;
     free_pending(temp);
   }
-  evconnlistener_free(levws->lev);
-  free(levws);
+  if (levws->accept_ev)
+    event_free(levws->accept_ev);
+#ifdef EVWS_HAVE_URING
+  if (levws->uring_accept)
+    stop_uring_accept(levws);
+#endif
+  if (levws->lev)
+    evconnlistener_free(levws->lev);
+  free_handshake_threads(levws);
+  evwsbase_decref(levws->wsbase);
+  evws_free(levws);
 }
 
 struct evconnlistener *evconnlistener_get_evconnlistener(
@@ -269,6 +1009,249 @@ void evwsconnlistener_set_cb(struct evwsconnlistener *levws,
   levws->user_data = user_data;
 }
 
+void evwsconnlistener_set_userdata_size(struct evwsconnlistener *levws,
+    size_t size) {
+  levws->conn_config.userdata_size = size;
+}
+
+void evwsconnlistener_set_ktls(struct evwsconnlistener *levws, int enable) {
+  levws->conn_config.ktls = enable;
+}
+
+void evwsconnlistener_set_tls_record_sizing(struct evwsconnlistener *levws,
+    int enable) {
+  levws->conn_config.tls_record_sizing = enable;
+}
+
+void evwsconnlistener_set_idle_compaction(struct evwsconnlistener *levws,
+    const struct timeval *idle) {
+  if (idle == NULL) {
+    levws->conn_config.idle_timeout = NULL;
+    return;
+  }
+  // Common timeouts keep every connection's timer in one O(1) queue
+  levws->conn_config.idle_timeout = event_base_init_common_timeout(
+      evwsbase_get_base(levws->wsbase), idle);
+}
+
+void evwsconnlistener_set_direct_read(struct evwsconnlistener *levws,
+    int enable) {
+  levws->conn_config.direct_read = enable;
+}
+
+int evwsconnlistener_set_handshake_threads(struct evwsconnlistener *levws,
+    int nthreads) {
+  if (levws->server_ctx == NULL || levws->hs_workers != NULL ||
+      nthreads <= 0)
+    return -1;
+  struct evwshsworker* workers = (struct evwshsworker *)evws_malloc(
+      nthreads * sizeof(struct evwshsworker));
+  if (!workers)
+    return -1;
+  memset(workers, 0, nthreads * sizeof(struct evwshsworker));
+  pthread_mutex_init(&levws->hs_lock, NULL);
+  levws->hs_workers = workers;
+  levws->hs_nworkers = nthreads;
+  if (new_notify_pair(levws->hs_notify) < 0)
+    goto err;
+  levws->hs_done_ev = event_new(evwsbase_get_base(levws->wsbase),
+      levws->hs_notify[0], EV_READ|EV_PERSIST, handshakes_done_cb, levws);
+  if (!levws->hs_done_ev || event_add(levws->hs_done_ev, NULL) < 0) {
+    if (levws->hs_done_ev)
+      event_free(levws->hs_done_ev);
+    levws->hs_done_ev = NULL;
+    evutil_closesocket(levws->hs_notify[0]);
+    evutil_closesocket(levws->hs_notify[1]);
+    goto err;
+  }
+
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    struct evwshsworker* worker = &workers[i];
+    worker->levws = levws;
+    if (new_notify_pair(worker->notify) < 0)
+      goto err;
+    worker->base = event_base_new();
+    if (worker->base)
+      worker->notify_ev = event_new(worker->base, worker->notify[0],
+          EV_READ|EV_PERSIST, worker_notify_cb, worker);
+    if (!worker->notify_ev || event_add(worker->notify_ev, NULL) < 0 ||
+        pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+      if (worker->notify_ev)
+        event_free(worker->notify_ev);
+      if (worker->base)
+        event_base_free(worker->base);
+      worker->base = NULL;
+      evutil_closesocket(worker->notify[0]);
+      evutil_closesocket(worker->notify[1]);
+      goto err;
+    }
+  }
+  return 0;
+
+err:
+  free_handshake_threads(levws);
+  return -1;
+}
+
+int evwsconnlistener_set_early_data(struct evwsconnlistener *levws,
+    uint32_t max_early_data, evwsconnlistener_early_data_cb cb,
+    void *user_data) {
+#ifdef EVWS_HAVE_EARLY_DATA
+  if (levws->server_ctx == NULL)
+    return -1;
+  levws->max_early_data = max_early_data;
+  levws->early_data_cb = cb;
+  levws->early_data_arg = user_data;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int evwsconnlistener_set_defer_accept(struct evwsconnlistener *levws,
+    int timeout_secs) {
+#ifdef TCP_DEFER_ACCEPT
+  return setsockopt(evconnlistener_get_fd(levws->lev), IPPROTO_TCP,
+      TCP_DEFER_ACCEPT, &timeout_secs, sizeof(timeout_secs));
+#else
+  return -1;
+#endif
+}
+
+int evwsconnlistener_set_fastopen(struct evwsconnlistener *levws, int qlen) {
+#ifdef TCP_FASTOPEN
+  return setsockopt(evconnlistener_get_fd(levws->lev), IPPROTO_TCP,
+      TCP_FASTOPEN, &qlen, sizeof(qlen));
+#else
+  return -1;
+#endif
+}
+
+int evwsconnlistener_set_max_accepts(struct evwsconnlistener *levws,
+    int max) {
+  if (max <= 0) {
+    if (levws->accept_ev) {
+      event_free(levws->accept_ev);
+      levws->accept_ev = NULL;
+      if (!levws->uring_accept)
+        evconnlistener_enable(levws->lev);
+    }
+    levws->max_accepts = 0;
+    return 0;
+  }
+  if (!levws->accept_ev) {
+    levws->accept_ev = event_new(evconnlistener_get_base(levws->lev),
+        evconnlistener_get_fd(levws->lev), EV_READ|EV_PERSIST, accept_cb,
+        levws);
+    if (!levws->accept_ev)
+      return -1;
+    if (!levws->uring_accept && event_add(levws->accept_ev, NULL) < 0) {
+      event_free(levws->accept_ev);
+      levws->accept_ev = NULL;
+      return -1;
+    }
+    evconnlistener_disable(levws->lev);
+  }
+  levws->max_accepts = max;
+  return 0;
+}
+
+void evwsconnlistener_set_notsent_lowat(struct evwsconnlistener *levws,
+    size_t bytes) {
+  levws->conn_config.notsent_lowat = bytes;
+}
+
+void evwsconnlistener_set_zerocopy(struct evwsconnlistener *levws,
+    size_t bytes) {
+  levws->conn_config.zerocopy_threshold = bytes;
+}
+
+void evwsconnlistener_set_max_frame_size(struct evwsconnlistener *levws,
+    size_t max_frame_size) {
+  levws->conn_config.max_frame_size = max_frame_size;
+}
+
+void evwsconnlistener_set_write_budget(struct evwsconnlistener *levws,
+    size_t bytes) {
+  levws->conn_config.write_budget = bytes;
+}
+
+void evwsconnlistener_set_read_budget(struct evwsconnlistener *levws,
+    size_t bytes, size_t messages) {
+  levws->conn_config.read_budget_bytes = bytes;
+  levws->conn_config.read_budget_messages = messages;
+}
+
+int evwsconnlistener_set_io_uring(struct evwsconnlistener *levws,
+    int enable) {
+#ifdef EVWS_HAVE_URING
+  if (!enable) {
+    levws->conn_config.io_uring = 0;
+    if (levws->uring_accept) {
+      stop_uring_accept(levws);
+      accept_normally(levws);
+    }
+    return 0;
+  }
+  if (!levws->uring_accept) {
+    struct evwsuring* ring = evwsuring_get(levws->wsbase);
+    if (!ring)
+      return -1;
+    struct evwsuringaccept* ua =
+        (struct evwsuringaccept*)evws_malloc(sizeof(struct evwsuringaccept));
+    if (!ua)
+      return -1;
+    memset(ua, 0, sizeof(struct evwsuringaccept));
+    ua->op.complete = uring_accept_done;
+    ua->orphan.release = free_accept;
+    ua->levws = levws;
+    ua->ring = ring;
+    ua->fd = evconnlistener_get_fd(levws->lev);
+    if (arm_accept(ua) < 0) {
+      evws_free(ua);
+      return -1;
+    }
+    levws->uring_accept = ua;
+    if (levws->accept_ev)
+      event_del(levws->accept_ev);
+    else
+      evconnlistener_disable(levws->lev);
+  }
+  levws->conn_config.io_uring = 1;
+  return 0;
+#else
+  return enable ? -1 : 0;
+#endif
+}
+
+void evwsconnlistener_set_sockopts(struct evwsconnlistener *levws,
+    const struct evws_sockopts *opts) {
+  levws->has_sockopts = opts != NULL;
+  if (opts)
+    levws->sockopts = *opts;
+}
+
+void evwsconnlistener_get_stats(struct evwsconnlistener *levws,
+    struct evwsconnlistener_stats *stats) {
+  *stats = levws->stats;
+}
+
+int evwsconnlistener_prewarm(struct evwsconnlistener *levws, size_t count) {
+  struct evws_pool* conn_pool = evwsbase_get_pool(levws->wsbase,
+      evwsconn_alloc_size(&levws->conn_config), EVWSCONN_ALIGN);
+  if (!conn_pool)
+    return -1;
+  if (evws_pool_prewarm(levws->pending_pool, count) < 0)
+    return -1;
+  return evws_pool_prewarm(conn_pool, count);
+}
+
+int evwsconnlistener_get_pool_stats(struct evwsconnlistener *levws,
+    struct evws_pool_stats *stats, int max) {
+  return evwsbase_get_pool_stats(levws->wsbase, stats, max);
+}
+
 void evwsconnlistener_set_error_cb(struct evwsconnlistener *levws,
     evwsconnlistener_errorcb errorcb) {
   levws->errorcb = errorcb;
@@ -0,0 +1,104 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evws/evws.h"
+
+// Calls made through the allocator hooks
+static int mallocs;
+static int frees;
+
+static void* count_malloc(size_t size, void* ctx) {
+  mallocs++;
+  return malloc(size);
+}
+
+static void* count_realloc(void* ptr, size_t size, void* ctx) {
+  return realloc(ptr, size);
+}
+
+static void count_free(void* ptr, void* ctx) {
+  frees++;
+  free(ptr);
+}
+
+struct buf_test {
+  const char* data;
+  size_t len;
+  int refs;
+};
+
+struct buf_test buf_tests[] = {
+    {"", 0, 0},
+    {"x", 1, 0},
+    {"hello", 5, 1},
+    {NULL, 1000, 3},
+    {"shared by many connections", 26, 1000},
+};
+
+static int run_buf_tests() {
+  evws_set_allocator(count_malloc, count_realloc, count_free, &mallocs);
+  int i;
+  for (i = 0; i < sizeof(buf_tests)/sizeof(struct buf_test); i++) {
+    struct buf_test* bt = buf_tests + i;
+    mallocs = frees = 0;
+    struct evwsbuf* buf = evwsbuf_new((const unsigned char*)bt->data,
+        bt->len);
+    if (buf == NULL || mallocs != 1 || evwsbuf_len(buf) != bt->len ||
+        (bt->data != NULL &&
+            memcmp(evwsbuf_data(buf), bt->data, bt->len))) {
+      fprintf(stderr, "FAIL: buf_test %d contents\n", i);
+      return -1;
+    }
+    int j;
+    for (j = 0; j < bt->refs; j++) {
+      evwsbuf_incref(buf);
+    }
+    for (j = 0; j < bt->refs; j++) {
+      evwsbuf_decref(buf);
+    }
+    if (frees != 0 || evwsbuf_len(buf) != bt->len) {
+      fprintf(stderr, "FAIL: buf_test %d freed with references left\n", i);
+      return -1;
+    }
+    evwsbuf_decref(buf);
+    if (frees != 1) {
+      fprintf(stderr, "FAIL: buf_test %d freed %d times\n", i, frees);
+      return -1;
+    }
+  }
+  evws_set_allocator(NULL, NULL, NULL, NULL);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (run_buf_tests() < 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,930 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <wslay/wslay.h>
+
+#include "evws/evws.h"
+#include "evws-internal.h"
+#include "evws_util.h"
+
+static struct event_base* base;
+static struct evwsbase* wsbase;
+
+// Create a connection on one end of a socket pair, the other end is returned
+// in peer
+static struct evwsconn* new_conn(const struct evwsconn_config* config,
+    int* peer) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return NULL;
+  }
+  evutil_make_socket_nonblocking(fds[0]);
+  evutil_make_socket_nonblocking(fds[1]);
+  struct bufferevent* bev = bufferevent_socket_new(base, fds[0],
+      BEV_OPT_CLOSE_ON_FREE);
+  if (bev != NULL) {
+    bufferevent_enable(bev, EV_READ);
+  }
+  struct evwsconn* conn =
+      bev == NULL ? NULL : evwsconn_new(wsbase, bev, NULL, config);
+  if (conn == NULL) {
+    if (bev != NULL) {
+      bufferevent_free(bev);
+    } else {
+      close(fds[0]);
+    }
+    close(fds[1]);
+    return NULL;
+  }
+  *peer = fds[1];
+  return conn;
+}
+
+// Send a frame from a client, masked with a zero key so the payload is sent
+// as is
+static int send_frame(int peer, uint8_t opcode, int fin, const char* data,
+    size_t len) {
+  unsigned char* frame = (unsigned char*)malloc(EVWS_FRAME_HEADER_MAX + 4 +
+      len);
+  if (frame == NULL) {
+    return -1;
+  }
+  size_t header_len = evws_frame_header(frame, opcode, fin, len);
+  frame[1] |= 0x80;
+  memset(frame + header_len, 0, 4);
+  memcpy(frame + header_len + 4, data, len);
+  size_t n = header_len + 4 + len;
+  int ret = send(peer, frame, n, 0) == (ssize_t)n ? 0 : -1;
+  free(frame);
+  return ret;
+}
+
+// What the callbacks below have been called with
+static int messages;
+static int batches;
+static size_t batched;
+static size_t streamed;
+static int fins;
+
+static void count_message_cb(struct evwsconn* conn,
+    enum evws_data_type data_type, const unsigned char* data, int len,
+    void* user_data) {
+  messages++;
+}
+
+static void count_batch_cb(struct evwsconn* conn, const struct evws_msg* msgs,
+    size_t n, void* user_data) {
+  batches++;
+  batched += n;
+}
+
+static void count_stream_cb(struct evwsconn* conn,
+    enum evws_data_type data_type, const unsigned char* data, size_t len,
+    int fin, void* user_data) {
+  streamed += len;
+  fins += fin;
+}
+
+static void reset_counts() {
+  messages = batches = fins = 0;
+  batched = streamed = 0;
+}
+
+static void run_loop() {
+  int i;
+  for (i = 0; i < 4; i++) {
+    event_base_loop(base, EVLOOP_NONBLOCK);
+  }
+}
+
+struct userdata_test {
+  size_t userdata_size;
+  int conns;
+};
+
+struct userdata_test userdata_tests[] = {
+    {0, 3},
+    {1, 3},
+    {15, 2},
+    {16, 2},
+    {17, 5},
+    {100, 3},
+    {4096, 2},
+};
+
+static int run_userdata_tests() {
+  struct evwsconn_config config;
+  memset(&config, 0, sizeof(config));
+  size_t conn_size = evwsconn_alloc_size(&config);
+  size_t offset = (conn_size + 15) & ~(size_t)15;
+  int i;
+  for (i = 0; i < sizeof(userdata_tests)/sizeof(struct userdata_test); i++) {
+    struct userdata_test* ut = userdata_tests + i;
+    config.userdata_size = ut->userdata_size;
+    size_t size = evwsconn_alloc_size(&config);
+    if (size != (ut->userdata_size ? offset + ut->userdata_size :
+        conn_size)) {
+      fprintf(stderr, "FAIL: userdata_test %d alloc size %zu\n", i, size);
+      return -1;
+    }
+
+    // Each connection's area is zero-filled, aligned, lies within the
+    // allocation and can be filled without touching its neighbours
+    struct evwsconn* conns[8];
+    int peers[8];
+    int j;
+    for (j = 0; j < ut->conns; j++) {
+      conns[j] = new_conn(&config, &peers[j]);
+      if (conns[j] == NULL || (uintptr_t)conns[j] % EVWSCONN_ALIGN != 0) {
+        fprintf(stderr, "FAIL: userdata_test %d connection %d\n", i, j);
+        return -1;
+      }
+      unsigned char* area =
+          (unsigned char*)evwsconn_get_userdata_area(conns[j]);
+      if (ut->userdata_size == 0) {
+        if (area != NULL) {
+          fprintf(stderr, "FAIL: userdata_test %d unexpected area\n", i);
+          return -1;
+        }
+        continue;
+      }
+      size_t k;
+      for (k = 0; k < ut->userdata_size && area[k] == 0; k++) {
+      }
+      if (area != (unsigned char*)conns[j] + offset ||
+          (uintptr_t)area % 16 != 0 || k != ut->userdata_size) {
+        fprintf(stderr, "FAIL: userdata_test %d area %p of connection %p\n",
+            i, area, conns[j]);
+        return -1;
+      }
+      memset(area, 0xff, ut->userdata_size);
+    }
+    for (j = 0; j < ut->conns; j++) {
+      evwsconn_send_message(conns[j], EVWS_DATA_TEXT,
+          (const unsigned char*)"ok", 2);
+    }
+    run_loop();
+    for (j = 0; j < ut->conns; j++) {
+      unsigned char frame[8];
+      if (recv(peers[j], frame, sizeof(frame), MSG_DONTWAIT) != 4 ||
+          memcmp(frame, "\x81\x02ok", 4)) {
+        fprintf(stderr, "FAIL: userdata_test %d connection %d overwritten\n",
+            i, j);
+        return -1;
+      }
+      evwsconn_free(conns[j]);
+      close(peers[j]);
+    }
+    run_loop();
+  }
+  return 0;
+}
+
+#define GROUP_CONNS 4
+
+// One step of a group test: 'a' adds conn to the group, 'A' adds it to a
+// second group, 'r' removes it from the group, 'R' from the second group,
+// and 'f' frees it.  members lists the connections that must receive a
+// broadcast to the group afterwards.
+struct group_step {
+  char op;
+  int conn;
+  int ret;
+  const char* members;
+};
+
+struct group_test {
+  struct group_step steps[12];
+};
+
+struct group_test group_tests[] = {
+    {{{'a', 0, 0, "0"}, {'a', 1, 0, "01"}, {'a', 2, 0, "012"},
+      {'r', 1, 0, "02"}, {'r', 0, 0, "2"}, {'r', 2, 0, ""}}},
+    // Removing from the middle moves the last connection into the gap
+    {{{'a', 0, 0, "0"}, {'a', 1, 0, "01"}, {'a', 2, 0, "012"},
+      {'a', 3, 0, "0123"}, {'r', 0, 0, "123"}, {'r', 3, 0, "12"},
+      {'a', 0, 0, "012"}, {'r', 2, 0, "01"}, {'r', 1, 0, "0"}}},
+    // A connection belongs to at most one group
+    {{{'a', 0, 0, "0"}, {'a', 0, -1, "0"}, {'A', 0, -1, "0"},
+      {'R', 0, 0, "0"}, {'A', 1, 0, "0"}, {'a', 1, -1, "0"},
+      {'r', 1, 0, "0"}, {'R', 1, 0, "0"}, {'a', 1, 0, "01"}}},
+    // Freeing a connection removes it from its group
+    {{{'a', 0, 0, "0"}, {'a', 1, 0, "01"}, {'a', 2, 0, "012"},
+      {'f', 0, 0, "12"}, {'a', 3, 0, "123"}, {'f', 3, 0, "12"},
+      {'f', 1, 0, "2"}}},
+};
+
+static int run_group_tests() {
+  struct evwsconn_config config;
+  memset(&config, 0, sizeof(config));
+  int i;
+  for (i = 0; i < sizeof(group_tests)/sizeof(struct group_test); i++) {
+    struct group_test* gt = group_tests + i;
+    struct evwsconngroup* group = evwsconngroup_new();
+    struct evwsconngroup* other = evwsconngroup_new();
+    struct evwsconn* conns[GROUP_CONNS];
+    int peers[GROUP_CONNS];
+    int j;
+    for (j = 0; j < GROUP_CONNS; j++) {
+      conns[j] = new_conn(&config, &peers[j]);
+      if (conns[j] == NULL) {
+        fprintf(stderr, "FAIL: group_test %d connection %d\n", i, j);
+        return -1;
+      }
+    }
+    int s;
+    for (s = 0; s < 12 && gt->steps[s].op; s++) {
+      struct group_step* gs = gt->steps + s;
+      struct evwsconn* conn = conns[gs->conn];
+      int ret = 0;
+      switch (gs->op) {
+        case 'a': ret = evwsconngroup_add(group, conn); break;
+        case 'A': ret = evwsconngroup_add(other, conn); break;
+        case 'r': evwsconngroup_remove(group, conn); break;
+        case 'R': evwsconngroup_remove(other, conn); break;
+        case 'f': evwsconn_free(conn); conns[gs->conn] = NULL; break;
+      }
+      if (ret != gs->ret ||
+          evwsconngroup_size(group) != strlen(gs->members)) {
+        fprintf(stderr, "FAIL: group_test %d step %d returned %d size %zu\n",
+            i, s, ret, evwsconngroup_size(group));
+        return -1;
+      }
+
+      // Exactly the members must receive the broadcast
+      unsigned char data = s;
+      evwsconngroup_broadcast(group, EVWS_DATA_BINARY, &data, 1);
+      run_loop();
+      for (j = 0; j < GROUP_CONNS; j++) {
+        unsigned char frame[8];
+        ssize_t n = recv(peers[j], frame, sizeof(frame), MSG_DONTWAIT);
+        int member = strchr(gs->members, '0' + j) != NULL;
+        if (member ? n != 3 || frame[0] != 0x82 || frame[1] != 1 ||
+                frame[2] != data :
+            n > 0) {
+          fprintf(stderr, "FAIL: group_test %d step %d connection %d "
+              "received %zd bytes\n", i, s, j, n);
+          return -1;
+        }
+      }
+    }
+    for (j = 0; j < GROUP_CONNS; j++) {
+      evwsconn_free(conns[j]);
+      close(peers[j]);
+    }
+    run_loop();
+    evwsconngroup_free(group);
+    evwsconngroup_free(other);
+  }
+  return 0;
+}
+
+struct stream_test {
+  int batch;
+  const char* frames[4];
+  size_t streamed;
+  int fins;
+};
+
+// Each frame is a data frame, the last of each message marked by a '.'
+struct stream_test stream_tests[] = {
+    {0, {"hello.", NULL}, 5, 1},
+    {1, {"hello.", NULL}, 5, 1},
+    {0, {"first", "second", "third.", NULL}, 16, 1},
+    {1, {"one.", "two.", "three.", NULL}, 11, 3},
+    {1, {".", ".", NULL}, 0, 2},
+};
+
+static int run_stream_tests() {
+  struct evwsconn_config config;
+  memset(&config, 0, sizeof(config));
+  int i;
+  for (i = 0; i < sizeof(stream_tests)/sizeof(struct stream_test); i++) {
+    struct stream_test* st = stream_tests + i;
+    int peer;
+    struct evwsconn* conn = new_conn(&config, &peer);
+    if (conn == NULL) {
+      fprintf(stderr, "FAIL: stream_test %d connection\n", i);
+      return -1;
+    }
+    evwsconn_set_cbs(conn, count_message_cb, NULL, NULL, NULL);
+    if (st->batch) {
+      evwsconn_set_batch_cb(conn, count_batch_cb);
+    }
+    evwsconn_set_stream_cb(conn, count_stream_cb);
+    reset_counts();
+    int first = 1;
+    int j;
+    for (j = 0; st->frames[j] != NULL; j++) {
+      size_t len = strlen(st->frames[j]);
+      int fin = len > 0 && st->frames[j][len - 1] == '.';
+      send_frame(peer, first ? WSLAY_BINARY_FRAME : WSLAY_CONTINUATION_FRAME,
+          fin, st->frames[j], fin ? len - 1 : len);
+      first = fin;
+    }
+    run_loop();
+    // the message and batch callbacks must never see the streamed messages
+    if (streamed != st->streamed || fins != st->fins || messages != 0 ||
+        batches != 0) {
+      fprintf(stderr, "FAIL: stream_test %d streamed %zu fins %d messages %d "
+          "batches %d\n", i, streamed, fins, messages, batches);
+      return -1;
+    }
+    evwsconn_free(conn);
+    close(peer);
+    run_loop();
+  }
+  return 0;
+}
+
+// Fail reallocations of more than this many bytes, 0 to allow any
+static size_t realloc_limit;
+
+static void* limit_malloc(size_t size, void* ctx) {
+  return malloc(size);
+}
+
+static void* limit_realloc(void* ptr, size_t size, void* ctx) {
+  return realloc_limit && size > realloc_limit ? NULL : realloc(ptr, size);
+}
+
+static void limit_free(void* ptr, void* ctx) {
+  free(ptr);
+}
+
+static void free_batch_cb(struct evwsconn* conn, const struct evws_msg* msgs,
+    size_t n, void* user_data) {
+  batches++;
+  batched += n;
+  evwsconn_free(conn);
+}
+
+static char last_batch[64];
+
+static void record_batch_cb(struct evwsconn* conn, const struct evws_msg* msgs,
+    size_t n, void* user_data) {
+  size_t i;
+  last_batch[0] = 0;
+  for (i = 0; i < n; i++) {
+    snprintf(last_batch + strlen(last_batch),
+        sizeof(last_batch) - strlen(last_batch), "%s%.*s", i ? "|" : "",
+        (int)msgs[i].len, (const char*)msgs[i].data);
+  }
+}
+
+/*
+ * The messages of a batch are collected on the base.  The first connection
+ * is freed from its batch callback part way through a read, when a large
+ * message can't be added to the batch, and nothing it received may reach
+ * the second connection's batch.
+ */
+static int run_batch_free_test() {
+  struct evwsconn_config config;
+  memset(&config, 0, sizeof(config));
+  // read the socket directly so that all of it is parsed in one read
+  config.direct_read = 1;
+  int peers[2];
+  struct evwsconn* first = new_conn(&config, &peers[0]);
+  struct evwsconn* second = new_conn(&config, &peers[1]);
+  if (first == NULL || second == NULL) {
+    fprintf(stderr, "FAIL: batch_free_test connections\n");
+    return -1;
+  }
+  evwsconn_set_batch_cb(first, free_batch_cb);
+  evwsconn_set_batch_cb(second, record_batch_cb);
+  static char large[60000];
+  memset(large, 'x', sizeof(large));
+  send_frame(peers[0], WSLAY_TEXT_FRAME, 1, "first", 5);
+  send_frame(peers[0], WSLAY_TEXT_FRAME, 1, large, sizeof(large));
+  send_frame(peers[0], WSLAY_TEXT_FRAME, 1, "after", 5);
+  reset_counts();
+  evws_set_allocator(limit_malloc, limit_realloc, limit_free, NULL);
+  realloc_limit = sizeof(large) / 2;
+  run_loop();
+  realloc_limit = 0;
+  evws_set_allocator(NULL, NULL, NULL, NULL);
+  send_frame(peers[1], WSLAY_TEXT_FRAME, 1, "second", 6);
+  run_loop();
+  if (batches != 1 || batched != 1 || strcmp(last_batch, "second")) {
+    fprintf(stderr, "FAIL: batch_free_test first got %d batches of %zu, "
+        "second got %s\n", batches, batched, last_batch);
+    return -1;
+  }
+  evwsconn_free(second);
+  close(peers[0]);
+  close(peers[1]);
+  run_loop();
+  return 0;
+}
+
+struct read_budget_test {
+  int direct_read;
+  size_t bytes;
+  size_t messages;
+  int count;
+  size_t len;
+};
+
+// The message budget is checked before each recv, so it only spreads out
+// messages longer than wslay reads at a time
+struct read_budget_test read_budget_tests[] = {
+    {1, 0, 2, 10, 3000},
+    {1, 4096, 0, 10, 3000},
+    {1, 200, 0, 20, 50},
+    {0, 1000, 1, 20, 100},
+};
+
+// Messages must arrive whole and in order, each filled with its index
+static size_t expected_len;
+static int out_of_order;
+
+static void check_message_cb(struct evwsconn* conn,
+    enum evws_data_type data_type, const unsigned char* data, int len,
+    void* user_data) {
+  if ((size_t)len != expected_len || data[0] != 'a' + messages % 26) {
+    out_of_order++;
+  }
+  messages++;
+}
+
+/*
+ * Everything is sent before the loop runs, so only the read budget spreads
+ * the messages over several loop iterations.
+ */
+static int run_read_budget_tests() {
+  int i;
+  for (i = 0; i < sizeof(read_budget_tests)/sizeof(struct read_budget_test);
+      i++) {
+    struct read_budget_test* rt = read_budget_tests + i;
+    struct evwsconn_config config;
+    memset(&config, 0, sizeof(config));
+    config.direct_read = rt->direct_read;
+    config.read_budget_bytes = rt->bytes;
+    config.read_budget_messages = rt->messages;
+    int peer;
+    struct evwsconn* conn = new_conn(&config, &peer);
+    if (conn == NULL) {
+      fprintf(stderr, "FAIL: read_budget_test %d connection\n", i);
+      return -1;
+    }
+    evwsconn_set_cbs(conn, check_message_cb, NULL, NULL, NULL);
+    reset_counts();
+    expected_len = rt->len;
+    out_of_order = 0;
+    char* data = (char*)malloc(rt->len);
+    int j;
+    for (j = 0; j < rt->count; j++) {
+      memset(data, 'a' + j % 26, rt->len);
+      send_frame(peer, WSLAY_BINARY_FRAME, 1, data, rt->len);
+    }
+    free(data);
+    int iterations = 0;
+    while (messages < rt->count && iterations < rt->count * 4) {
+      event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+      iterations++;
+    }
+    if (messages != rt->count || out_of_order != 0 || iterations < 2) {
+      fprintf(stderr, "FAIL: read_budget_test %d got %d messages, %d out of "
+          "order, in %d iterations\n", i, messages, out_of_order,
+          iterations);
+      return -1;
+    }
+    evwsconn_free(conn);
+    close(peer);
+    run_loop();
+  }
+  return 0;
+}
+
+struct free_test {
+  int conns;
+  // free each connection from its message callback rather than directly
+  int from_cb;
+};
+
+struct free_test free_tests[] = {
+    {1, 0},
+    {5, 0},
+    {5, 1},
+    {64, 0},
+};
+
+static void free_message_cb(struct evwsconn* conn,
+    enum evws_data_type data_type, const unsigned char* data, int len,
+    void* user_data) {
+  messages++;
+  evwsconn_free(conn);
+}
+
+// Whether the other end of a socket pair has been closed
+static int peer_closed(int peer) {
+  char c;
+  return recv(peer, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+/*
+ * Freed connections are queued on the base.  They must stay allocated, and
+ * their sockets open, until the loop next runs, which then frees them all.
+ */
+static int run_free_tests() {
+  struct evwsconn_config config;
+  memset(&config, 0, sizeof(config));
+  int i;
+  for (i = 0; i < sizeof(free_tests)/sizeof(struct free_test); i++) {
+    struct free_test* ft = free_tests + i;
+    struct evwsconn* conns[64];
+    int peers[64];
+    int refcnt = wsbase->refcnt;
+    int j;
+    for (j = 0; j < ft->conns; j++) {
+      conns[j] = new_conn(&config, &peers[j]);
+      if (conns[j] == NULL) {
+        fprintf(stderr, "FAIL: free_test %d connection %d\n", i, j);
+        return -1;
+      }
+    }
+    reset_counts();
+    for (j = 0; j < ft->conns; j++) {
+      if (ft->from_cb) {
+        // nothing after the message that frees the connection is delivered
+        evwsconn_set_cbs(conns[j], free_message_cb, NULL, NULL, NULL);
+        send_frame(peers[j], WSLAY_TEXT_FRAME, 1, "free", 4);
+        send_frame(peers[j], WSLAY_TEXT_FRAME, 1, "late", 4);
+      } else {
+        evwsconn_free(conns[j]);
+        evwsconn_free(conns[j]);
+      }
+    }
+    if (!ft->from_cb && (wsbase->free_head == NULL ||
+        wsbase->refcnt != refcnt + ft->conns || peer_closed(peers[0]))) {
+      fprintf(stderr, "FAIL: free_test %d freed before the loop ran\n", i);
+      return -1;
+    }
+    if (ft->from_cb) {
+      run_loop();
+    } else {
+      event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+    }
+    int closed = 0;
+    for (j = 0; j < ft->conns; j++) {
+      closed += peer_closed(peers[j]);
+      close(peers[j]);
+    }
+    if (wsbase->free_head != NULL || wsbase->refcnt != refcnt ||
+        closed != ft->conns || (ft->from_cb && messages != ft->conns)) {
+      fprintf(stderr, "FAIL: free_test %d left %d references, closed %d, "
+          "got %d messages\n", i, wsbase->refcnt - refcnt, closed,
+          messages);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct pacing_test {
+  size_t notsent_lowat;
+  // the peer's receive buffer and the connection's send buffer, 0 to leave
+  // them as they are
+  int sockbuf;
+  int count;
+  size_t len;
+};
+
+struct pacing_test pacing_tests[] = {
+    {1000, 0, 20, 300},
+    {1000, 4096, 100, 1000},
+    {16384, 4096, 10, 20000},
+};
+
+static int writables;
+static int early_writables;
+
+static void count_writable_cb(struct evwsconn* conn, void* user_data) {
+  struct evwsconn_stats stats;
+  evwsconn_get_stats(conn, &stats);
+  writables++;
+  early_writables += stats.queued_bytes > 0;
+}
+
+/*
+ * Only up to the low mark is passed to the bufferevent; the rest waits in
+ * the library's queue until the socket takes it, and the writable callback
+ * only runs once that queue is empty.
+ */
+static int run_pacing_tests() {
+  int i;
+  for (i = 0; i < sizeof(pacing_tests)/sizeof(struct pacing_test); i++) {
+    struct pacing_test* pt = pacing_tests + i;
+    struct evwsconn_config config;
+    memset(&config, 0, sizeof(config));
+    config.notsent_lowat = pt->notsent_lowat;
+    int peer;
+    struct evwsconn* conn = new_conn(&config, &peer);
+    if (conn == NULL) {
+      fprintf(stderr, "FAIL: pacing_test %d connection\n", i);
+      return -1;
+    }
+    struct bufferevent* bev = evwsconn_get_bufferevent(conn);
+    if (pt->sockbuf > 0) {
+      setsockopt(peer, SOL_SOCKET, SO_RCVBUF, &pt->sockbuf,
+          sizeof(pt->sockbuf));
+      setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_SNDBUF, &pt->sockbuf,
+          sizeof(pt->sockbuf));
+    }
+    evwsconn_set_writable_cb(conn, count_writable_cb);
+    writables = early_writables = 0;
+    unsigned char* data = (unsigned char*)malloc(pt->len);
+    int j;
+    for (j = 0; j < pt->count; j++) {
+      memset(data, 'a' + j % 26, pt->len);
+      evwsconn_send_message(conn, EVWS_DATA_BINARY, data, pt->len);
+    }
+    struct evwsconn_stats stats;
+    evwsconn_get_stats(conn, &stats);
+    size_t output = evbuffer_get_length(bufferevent_get_output(bev));
+    if (output > pt->notsent_lowat || stats.queued_bytes == 0) {
+      fprintf(stderr, "FAIL: pacing_test %d passed on %zu bytes, queued "
+          "%zu\n", i, output, stats.queued_bytes);
+      return -1;
+    }
+    // read as the client would, checking that each message arrives whole
+    size_t frame_len = pt->len + (pt->len < 126 ? 2 : pt->len < 65536 ? 4 :
+        10);
+    size_t total = frame_len * pt->count;
+    unsigned char* received = (unsigned char*)malloc(total + 1);
+    size_t received_len = 0;
+    int iterations;
+    for (iterations = 0; iterations < 1000 && received_len < total;
+        iterations++) {
+      event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+      ssize_t n = recv(peer, received + received_len,
+          total + 1 - received_len, MSG_DONTWAIT);
+      if (n > 0) {
+        received_len += n;
+      }
+    }
+    run_loop();
+    int bad = 0;
+    for (j = 0; received_len == total && j < pt->count; j++) {
+      unsigned char* frame = received + j * frame_len;
+      if (evws_frame_length(frame, frame_len) != frame_len ||
+          frame[frame_len - pt->len] != 'a' + j % 26 ||
+          frame[frame_len - 1] != 'a' + j % 26) {
+        bad++;
+      }
+    }
+    evwsconn_get_stats(conn, &stats);
+    if (received_len != total || bad || stats.queued_bytes != 0 ||
+        writables == 0 || early_writables != 0) {
+      fprintf(stderr, "FAIL: pacing_test %d received %zu of %zu bytes, %d "
+          "bad frames, %zu queued, %d writable calls, %d early\n", i,
+          received_len, total, bad, stats.queued_bytes, writables,
+          early_writables);
+      return -1;
+    }
+    free(data);
+    free(received);
+    evwsconn_free(conn);
+    close(peer);
+    run_loop();
+  }
+  return 0;
+}
+
+struct reserve_test {
+  size_t notsent_lowat;
+  size_t max_len;
+  size_t used;
+  int ret;
+};
+
+// Where max_len and used fall in different length ranges (up to 125 bytes,
+// up to 64 KB, and above), less header is needed than was reserved
+struct reserve_test reserve_tests[] = {
+    {0, 10, 10, 0},
+    {0, 125, 5, 0},
+    {0, 126, 125, 0},
+    {0, 200, 0, 0},
+    {0, 70000, 100, 0},
+    {0, 70000, 300, 0},
+    {0, 70000, 70000, 0},
+    {1000, 70000, 300, 0},
+    {1000, 70000, 5, 0},
+    {0, 100, 101, -1},
+};
+
+// Read from a peer, running the loop, until len bytes have arrived
+static size_t recv_all(int peer, unsigned char* buf, size_t len) {
+  size_t received = 0;
+  int i;
+  for (i = 0; i < 1000 && received < len; i++) {
+    event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+    ssize_t n = recv(peer, buf + received, len - received, MSG_DONTWAIT);
+    if (n > 0) {
+      received += n;
+    }
+  }
+  return received;
+}
+
+/*
+ * A message built in reserved space must go out with the shortest header
+ * for the length actually used, the payload moved up against it.
+ */
+static int run_reserve_tests() {
+  int i;
+  for (i = 0; i < sizeof(reserve_tests)/sizeof(struct reserve_test); i++) {
+    struct reserve_test* rt = reserve_tests + i;
+    struct evwsconn_config config;
+    memset(&config, 0, sizeof(config));
+    config.notsent_lowat = rt->notsent_lowat;
+    int peer;
+    struct evwsconn* conn = new_conn(&config, &peer);
+    if (conn == NULL) {
+      fprintf(stderr, "FAIL: reserve_test %d connection\n", i);
+      return -1;
+    }
+    if (evwsconn_commit(conn, EVWS_DATA_BINARY, 0) != -1) {
+      fprintf(stderr, "FAIL: reserve_test %d committed nothing\n", i);
+      return -1;
+    }
+    unsigned char* space = evwsconn_reserve(conn, rt->max_len);
+    if (space == NULL) {
+      fprintf(stderr, "FAIL: reserve_test %d reserve\n", i);
+      return -1;
+    }
+    size_t j;
+    for (j = 0; j < rt->max_len; j++) {
+      space[j] = j < rt->used ? j % 251 : 0xff;
+    }
+    int ret = evwsconn_commit(conn, EVWS_DATA_BINARY, rt->used);
+    if (ret != rt->ret) {
+      fprintf(stderr, "FAIL: reserve_test %d commit returned %d\n", i, ret);
+      return -1;
+    }
+    if (ret == 0) {
+      unsigned char* expected = (unsigned char*)malloc(
+          EVWS_FRAME_HEADER_MAX + rt->used);
+      size_t len = evws_frame_header(expected, WSLAY_BINARY_FRAME, 1,
+          rt->used);
+      for (j = 0; j < rt->used; j++) {
+        expected[len++] = j % 251;
+      }
+      unsigned char* received = (unsigned char*)malloc(len);
+      size_t received_len = recv_all(peer, received, len);
+      int same = received_len == len && !memcmp(received, expected, len);
+      free(expected);
+      free(received);
+      if (!same) {
+        fprintf(stderr, "FAIL: reserve_test %d sent %zu bytes, wrong "
+            "frame\n", i, received_len);
+        return -1;
+      }
+    }
+    evwsconn_free(conn);
+    close(peer);
+    run_loop();
+  }
+  return 0;
+}
+
+struct send_messages_test {
+  size_t notsent_lowat;
+  // sent alternately as text and binary, after one sent on its own
+  const char* msgs[6];
+  // the length of a binary message sent last, 0 for none
+  size_t big;
+};
+
+struct send_messages_test send_messages_tests[] = {
+    {0, {NULL}, 0},
+    {0, {"one", NULL}, 0},
+    {0, {"one", "", "three", "four", NULL}, 0},
+    {0, {"a", "b", NULL}, 300},
+    {0, {NULL}, 70000},
+    {100, {"one", "two", "three", NULL}, 1000},
+};
+
+/*
+ * The frames of a batch must reach the client in order, after whatever was
+ * sent before, exactly as if each message had been sent on its own.
+ */
+static int run_send_messages_tests() {
+  int i;
+  for (i = 0; i < sizeof(send_messages_tests)/
+      sizeof(struct send_messages_test); i++) {
+    struct send_messages_test* st = send_messages_tests + i;
+    struct evwsconn_config config;
+    memset(&config, 0, sizeof(config));
+    config.notsent_lowat = st->notsent_lowat;
+    int peer;
+    struct evwsconn* conn = new_conn(&config, &peer);
+    if (conn == NULL) {
+      fprintf(stderr, "FAIL: send_messages_test %d connection\n", i);
+      return -1;
+    }
+    struct evws_msg msgs[6];
+    unsigned char* big = (unsigned char*)malloc(st->big + 1);
+    memset(big, 'z', st->big);
+    size_t n;
+    for (n = 0; st->msgs[n] != NULL; n++) {
+      msgs[n].data_type = n % 2 ? EVWS_DATA_BINARY : EVWS_DATA_TEXT;
+      msgs[n].data = (const unsigned char*)st->msgs[n];
+      msgs[n].len = strlen(st->msgs[n]);
+    }
+    if (st->big > 0) {
+      msgs[n].data_type = EVWS_DATA_BINARY;
+      msgs[n].data = big;
+      msgs[n++].len = st->big;
+    }
+    // the frames the client should receive
+    size_t total = EVWS_FRAME_HEADER_MAX + 1;
+    size_t j;
+    for (j = 0; j < n; j++) {
+      total += EVWS_FRAME_HEADER_MAX + msgs[j].len;
+    }
+    unsigned char* expected = (unsigned char*)malloc(total);
+    size_t len = evws_frame_header(expected, WSLAY_TEXT_FRAME, 1, 1);
+    expected[len++] = '0';
+    for (j = 0; j < n; j++) {
+      len += evws_frame_header(expected + len,
+          msgs[j].data_type == EVWS_DATA_TEXT ? WSLAY_TEXT_FRAME :
+              WSLAY_BINARY_FRAME, 1, msgs[j].len);
+      memcpy(expected + len, msgs[j].data, msgs[j].len);
+      len += msgs[j].len;
+    }
+    evwsconn_send_message(conn, EVWS_DATA_TEXT, (const unsigned char*)"0",
+        1);
+    int ret = evwsconn_send_messages(conn, msgs, n);
+    unsigned char* received = (unsigned char*)malloc(len);
+    size_t received_len = recv_all(peer, received, len);
+    int same = received_len == len && !memcmp(received, expected, len);
+    free(big);
+    free(expected);
+    free(received);
+    if (ret != 0 || !same) {
+      fprintf(stderr, "FAIL: send_messages_test %d returned %d, sent %zu of "
+          "%zu bytes\n", i, ret, received_len, len);
+      return -1;
+    }
+    // nothing may follow the close frame
+    evwsconn_send_close(conn);
+    if (n > 0 && evwsconn_send_messages(conn, msgs, n) != -1) {
+      fprintf(stderr, "FAIL: send_messages_test %d sent after closing\n", i);
+      return -1;
+    }
+    evwsconn_free(conn);
+    close(peer);
+    run_loop();
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  base = event_base_new();
+  wsbase = base == NULL ? NULL : evwsbase_get(base);
+  if (wsbase == NULL) {
+    fprintf(stderr, "FAIL: could not create the event base\n");
+    return -1;
+  }
+  int ret = run_userdata_tests() < 0 || run_group_tests() < 0 ||
+      run_stream_tests() < 0 || run_batch_free_test() < 0 ||
+      run_read_budget_tests() < 0 || run_free_tests() < 0 ||
+      run_pacing_tests() < 0 || run_reserve_tests() < 0 ||
+      run_send_messages_tests() < 0 ? -1 : 0;
+  evwsbase_decref(wsbase);
+  event_base_free(base);
+  return ret;
+}
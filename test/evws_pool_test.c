@@ -0,0 +1,191 @@
+/*
+ * libevws
+ *
+ * Copyright (c) 2013 github.com/crunchyfrog
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evws/evws.h"
+#include "evws-internal.h"
+#include "evws_pool.h"
+
+// Calls made through the allocator hooks
+static int mallocs;
+static int reallocs;
+static int frees;
+static int ctx_ok;
+
+static void* count_malloc(size_t size, void* ctx) {
+  mallocs++;
+  ctx_ok = ctx == &mallocs;
+  return malloc(size);
+}
+
+static void* count_realloc(void* ptr, size_t size, void* ctx) {
+  reallocs++;
+  ctx_ok = ctx == &mallocs;
+  return realloc(ptr, size);
+}
+
+static void count_free(void* ptr, void* ctx) {
+  frees++;
+  ctx_ok = ctx == &mallocs;
+  free(ptr);
+}
+
+struct mem_test {
+  evws_malloc_fn malloc_fn;
+  evws_realloc_fn realloc_fn;
+  evws_free_fn free_fn;
+  int routed;
+};
+
+struct mem_test mem_tests[] = {
+    {count_malloc, count_realloc, count_free, 1},
+    {NULL, NULL, NULL, 0},
+    {count_malloc, count_realloc, NULL, 0},
+    {count_malloc, NULL, count_free, 0},
+    {NULL, count_realloc, count_free, 0},
+};
+
+static int run_mem_tests() {
+  int i;
+  for (i = 0; i < sizeof(mem_tests)/sizeof(struct mem_test); i++) {
+    struct mem_test* mt = mem_tests + i;
+    evws_set_allocator(mt->malloc_fn, mt->realloc_fn, mt->free_fn, &mallocs);
+    mallocs = reallocs = frees = 0;
+    ctx_ok = 1;
+    void* p = evws_malloc(16);
+    p = evws_realloc(p, 4096);
+    evws_free(p);
+    evws_free(NULL);
+    int expected = mt->routed ? 1 : 0;
+    if (p == NULL || mallocs != expected || reallocs != expected ||
+        frees != expected || !ctx_ok) {
+      fprintf(stderr, "FAIL: mem_test %d malloc %d realloc %d free %d\n", i,
+          mallocs, reallocs, frees);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct pool_test {
+  size_t object_size;
+  size_t align;
+  size_t prewarm;
+  size_t allocs;
+  size_t frees;
+  size_t expected_object_size;
+  size_t expected_align;
+};
+
+struct pool_test pool_tests[] = {
+    {1, 0, 0, 1, 1, 16, 16},
+    {24, 0, 0, 100, 50, 32, 16},
+    {24, 8, 10, 10, 10, 32, 16},
+    {100, 64, 0, 5, 0, 128, 64},
+    {300, 64, 1000, 1000, 999, 320, 64},
+    {4096, 4096, 3, 40, 20, 4096, 4096},
+    {65536, 0, 0, 17, 17, 65536, 16},
+};
+
+static int run_pool_tests() {
+  evws_set_allocator(count_malloc, count_realloc, count_free, &mallocs);
+  int i;
+  for (i = 0; i < sizeof(pool_tests)/sizeof(struct pool_test); i++) {
+    struct pool_test* pt = pool_tests + i;
+    struct evws_pool pool;
+    evws_pool_init(&pool, pt->object_size, pt->align);
+    if (pool.object_size != pt->expected_object_size ||
+        pool.align != pt->expected_align) {
+      fprintf(stderr, "FAIL: pool_test %d object size %zu align %zu\n", i,
+          pool.object_size, pool.align);
+      return -1;
+    }
+    if (evws_pool_prewarm(&pool, pt->prewarm) < 0 ||
+        pool.allocated < pt->prewarm) {
+      fprintf(stderr, "FAIL: pool_test %d prewarmed %zu\n", i,
+          pool.allocated);
+      return -1;
+    }
+
+    // Nothing that fits in the prewarmed slabs may reach the allocator
+    mallocs = 0;
+    void** objs = (void**)calloc(pt->allocs, sizeof(void*));
+    size_t j;
+    for (j = 0; j < pt->allocs; j++) {
+      objs[j] = evws_pool_alloc(&pool);
+      if (objs[j] == NULL ||
+          (uintptr_t)objs[j] % pt->expected_align != 0) {
+        fprintf(stderr, "FAIL: pool_test %d object %zu at %p\n", i, j,
+            objs[j]);
+        return -1;
+      }
+      memset(objs[j], 0xa5, pool.object_size);
+    }
+    if (pt->allocs <= pt->prewarm && mallocs != 0) {
+      fprintf(stderr, "FAIL: pool_test %d grew past its prewarm\n", i);
+      return -1;
+    }
+
+    // Freed objects are handed out again without growing the pool, and the
+    // high-water mark stays at the most ever in use
+    for (j = 0; j < pt->frees; j++) {
+      evws_pool_free(&pool, objs[j]);
+    }
+    size_t allocated = pool.allocated;
+    for (j = 0; j < pt->frees; j++) {
+      objs[j] = evws_pool_alloc(&pool);
+    }
+    if (pool.in_use != pt->allocs || pool.high_water != pt->allocs ||
+        pool.allocated != allocated) {
+      fprintf(stderr, "FAIL: pool_test %d in use %zu high water %zu\n", i,
+          pool.in_use, pool.high_water);
+      return -1;
+    }
+
+    for (j = 0; j < pt->allocs; j++) {
+      evws_pool_free(&pool, objs[j]);
+    }
+    free(objs);
+    frees = 0;
+    evws_pool_destroy(&pool);
+    if (pool.allocated != 0 || (frees > 0) != (allocated > 0)) {
+      fprintf(stderr, "FAIL: pool_test %d destroy\n", i);
+      return -1;
+    }
+  }
+  evws_set_allocator(NULL, NULL, NULL, NULL);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (run_mem_tests() < 0 || run_pool_tests() < 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -245,6 +245,45 @@ struct header_test header_tests[] = {
     },
 };
 
+struct frame_header_test {
+  uint8_t opcode;
+  int fin;
+  uint64_t payload_len;
+  size_t header_len;
+  unsigned char header[EVWS_FRAME_HEADER_MAX];
+};
+
+struct frame_header_test frame_header_tests[] = {
+    {0x1, 1, 0, 2, {0x81, 0x00}},
+    {0x2, 1, 125, 2, {0x82, 0x7d}},
+    {0x1, 1, 126, 4, {0x81, 0x7e, 0x00, 0x7e}},
+    {0x2, 0, 65535, 4, {0x02, 0x7e, 0xff, 0xff}},
+    {0x0, 1, 65536, 10, {0x80, 0x7f, 0, 0, 0, 0, 0, 0x01, 0x00, 0x00}},
+    {0x2, 1, 0x0102030405ULL, 10,
+        {0x82, 0x7f, 0, 0, 0, 0x01, 0x02, 0x03, 0x04, 0x05}},
+};
+
+static int run_frame_header_tests() {
+  int i;
+  for (i = 0; i < sizeof(frame_header_tests)/sizeof(struct frame_header_test);
+      i++) {
+    struct frame_header_test* ft = frame_header_tests + i;
+    unsigned char header[EVWS_FRAME_HEADER_MAX];
+    size_t len = evws_frame_header(header, ft->opcode, ft->fin,
+        ft->payload_len);
+    if (len != ft->header_len || memcmp(header, ft->header, len)) {
+      fprintf(stderr, "FAIL: frame_header_test %d incorrect header\n", i);
+      return -1;
+    }
+    if (evws_frame_length(header, len) != len + ft->payload_len ||
+        evws_frame_length(header, len - 1) != 0) {
+      fprintf(stderr, "FAIL: frame_header_test %d incorrect length\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   int i;
   for (i = 0; i < sizeof(header_tests)/sizeof(struct header_test); i++) {
@@ -283,5 +322,5 @@ int main(int argc, char** argv) {
       }
     }
   }
-  return 0;
+  return run_frame_header_tests();
 }